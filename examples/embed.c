@@ -0,0 +1,83 @@
+// a host driving a long-lived VM through the embedding API: make example && ./examples/embed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/embedding.h"
+
+#define CALLS 10000
+
+static const char* script =
+    "let calls = 0\n"
+    "func add(a, b)\n"
+    "    calls = calls + 1\n"
+    "    let garbage = [a, b, tostr(a) ++ tostr(b)]\n"
+    "    ret a + b\n"
+    "func count()\n"
+    "    ret calls\n"
+    "let i = 0\n"
+    "while i < 20000\n"
+    "    let garbage = tostr(i)\n"
+    "    i = i + 1\n"
+    "let label = 'calls ' ++ tostr(calls)\n";
+
+// allocates enough to run minor collections, which copy the survivors out of the nursery
+static const char* churn =
+    "let kept = []\n"
+    "let i = 0\n"
+    "while i < 20000\n"
+    "    kept = kept ++ [tostr(i)]\n"
+    "    i = i + 1\n";
+
+static int fail(const char* message) {
+    fprintf(stderr, "embed: %s\n", message);
+    return 1;
+}
+
+int main(void) {
+    VM* vm = vmNew();
+    if (vm == NULL)
+        return fail("cannot create a VM");
+    ObjFunction* loaded = vmLoad(vm, script);
+    if (loaded == NULL || !vmExecute(vm, loaded))
+        return fail("cannot run the script");
+
+    // the functions stay alive across the collections the calls trigger
+    Value add, count, label, result;
+    if (!vmGetGlobal(vm, "add", &add) || !vmGetGlobal(vm, "count", &count) || !vmGetGlobal(vm, "label", &label))
+        return fail("missing global");
+    vmRetain(vm, add);
+    vmRetain(vm, count);
+    vmRetain(vm, label);
+
+    // a retained young object stays where it is while another script runs
+    if (!vmInterpret(vm, churn))
+        return fail("cannot run the second script");
+    if (strcmp(as_cstring(vm->collector, label), "calls 0") != 0)
+        return fail("a retained value moved");
+
+    for (int i = 0; i < CALLS; i++) {
+        Value args[2] = {to_vnumber(i), to_vnumber(1)};
+        if (!vmCall(vm, add, 2, args, &result) || !is_number(result) || as_cnumber(result) != i + 1)
+            return fail("wrong result from add");
+    }
+
+    // more arguments than the stack holds are a runtime error, after which the VM is still usable
+    int many = MAX_STACK + 1;
+    Value* args = (Value*) calloc(many, sizeof(Value));
+    if (args == NULL)
+        return fail("out of memory");
+    fprintf(stderr, "embed: expecting a stack overflow\n");
+    if (vmCall(vm, add, many, args, &result))
+        return fail("an oversized call succeeded");
+    free(args);
+    if (!vmCall(vm, count, 0, NULL, &result) || as_cnumber(result) != CALLS)
+        return fail("wrong call count");
+
+    vmRelease(vm, add);
+    vmRelease(vm, count);
+    vmRelease(vm, label);
+    vmFree(vm);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "compact.h"
+#include "memory.h"
+#include "./datastructs/bytecode.h"
+
+// objects are evacuated rather than slid: the sparse pages are emptied into the free blocks of
+// the others, and the old copy of each object keeps the address of the new one past its header
+#define forwarding(object) (*(Obj**) ((char*) (object) + sizeof(Obj)))
+
+// a bit per page address modulo 64, for the pages objects were moved out of
+#define page_bit(block) ((uint64_t) 1 << ((uintptr_t) (block) / SLAB_PAGE_SIZE % 64))
+
+struct sCompaction {
+    Collector* collector;
+    SlabPage** pages; // the evacuating pages, sorted by address
+    int count;
+    uint64_t moved; // page_bit of every page an object left: the others are not read while forwarding
+};
+
+static int comparePages(const void* a, const void* b) {
+    uintptr_t left = (uintptr_t) *(SlabPage* const*) a;
+    uintptr_t right = (uintptr_t) *(SlabPage* const*) b;
+    return left < right ? -1 : left > right;
+}
+
+// told by address alone: large strings and the blocks of collector-less maps have no page to read
+static int evacuated(Compaction* compaction, void* block) {
+    if (compaction->count == 0)
+        return 0;
+    SlabPage* page = slab_page(block);
+    if (page < compaction->pages[0] || page > compaction->pages[compaction->count - 1])
+        return 0;
+    return bsearch(&page, compaction->pages, compaction->count, sizeof(SlabPage*), comparePages) != NULL;
+}
+
+Obj* forwardObject(Compaction* compaction, Obj* object) {
+    if (object == NULL || !(compaction->moved & page_bit(object)) || !(object->flags & OBJ_MOVED))
+        return object;
+    return forwarding(object);
+}
+
+void forwardValue(Compaction* compaction, Value* value) {
+    if (is_obj(*value))
+        value->as.obj = forwardObject(compaction, as_obj(*value));
+}
+
+static void outOfMemory(void) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+}
+
+static void* allocateMoved(Compaction* compaction, size_t size) {
+    void* block = slabAllocate(&compaction->collector->slabs, size);
+    if (block == NULL)
+        outOfMemory();
+    return block;
+}
+
+// the blocks objects own in the slabs (bytecode and closed values) move with their owner
+static void* moveBlock(Compaction* compaction, void* block, size_t size) {
+    if (block == NULL || !evacuated(compaction, block))
+        return block;
+    void* moved = allocateMoved(compaction, size);
+    memcpy(moved, block, size);
+    slab_page(block)->foreignBytes -= slabBlockSize(size);
+    return moved;
+}
+
+static void forwardMap(Compaction* compaction, HashMap* map) {
+    for (int i = 0; i < map->count; i++) {
+        forwardValue(compaction, &map->entries[i].key);
+        forwardValue(compaction, &map->entries[i].value);
+    }
+}
+
+// fibers are embedded in their coroutine, the main one in the VM
+static Fiber* forwardFiberPointer(Compaction* compaction, Fiber* fiber) {
+    if (fiber == NULL || fiber == &compaction->collector->vm->mainFiber)
+        return fiber;
+    Obj* owner = (Obj*) ((char*) fiber - offsetof(ObjCoroutine, fiber));
+    return &((ObjCoroutine*) forwardObject(compaction, owner))->fiber;
+}
+
+static void forwardFiber(Compaction* compaction, Fiber* fiber) {
+    for (int i = 0; i < fiber->fp; i++)
+        fiber->frames[i].closure = (ObjClosure*) forwardObject(compaction, (Obj*) fiber->frames[i].closure);
+    for (Value* value = fiber->stack; value < fiber->sp; value++)
+        forwardValue(compaction, value);
+    fiber->openUpvalues = (ObjUpvalue*) forwardObject(compaction, (Obj*) fiber->openUpvalues);
+    // the list links old upvalues to younger ones without barriers
+    for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalue->next = (ObjUpvalue*) forwardObject(compaction, (Obj*) upvalue->next);
+    fiber->caller = forwardFiberPointer(compaction, fiber->caller);
+    fiber->owner = forwardObject(compaction, fiber->owner);
+}
+
+static void forwardFields(Compaction* compaction, Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            if (is_rope(object)) {
+                ObjRope* rope = (ObjRope*) object;
+                rope->left = (ObjString*) forwardObject(compaction, (Obj*) rope->left);
+                rope->right = (ObjString*) forwardObject(compaction, (Obj*) rope->right);
+            }
+            break;
+        case OBJ_CHANNEL:
+            break;
+        case OBJ_FUNCTION:
+            {
+                ObjFunction* function = (ObjFunction*) object;
+                function->name = (ObjString*) forwardObject(compaction, (Obj*) function->name);
+                function->bytecode = moveBlock(compaction, function->bytecode, sizeof(Bytecode));
+                ValueArray* constants = &function->bytecode->constants;
+                for (int i = 0; i < constants->count; i++)
+                    forwardValue(compaction, &constants->values[i]);
+                break;
+            }
+        case OBJ_NATIVE_FUNCTION:
+            {
+                ObjNativeFunction* native = (ObjNativeFunction*) object;
+                native->name = (ObjString*) forwardObject(compaction, (Obj*) native->name);
+                break;
+            }
+        case OBJ_CLOSURE:
+            {
+                ObjClosure* closure = (ObjClosure*) object;
+                closure->function = (ObjFunction*) forwardObject(compaction, (Obj*) closure->function);
+                for (int i = 0; i < closure->upvalueCount; i++)
+                    closure->upvalues[i] = (ObjUpvalue*) forwardObject(compaction, (Obj*) closure->upvalues[i]);
+                break;
+            }
+        case OBJ_UPVALUE:
+            {
+                // an open upvalue points into a stack, which is forwarded with its fiber
+                ObjUpvalue* upvalue = (ObjUpvalue*) object;
+                if (upvalue->closed != NULL) {
+                    upvalue->closed = moveBlock(compaction, upvalue->closed, sizeof(Value));
+                    upvalue->value = upvalue->closed;
+                    forwardValue(compaction, upvalue->closed);
+                }
+                upvalue->stackOwner = forwardObject(compaction, upvalue->stackOwner);
+                upvalue->next = (ObjUpvalue*) forwardObject(compaction, (Obj*) upvalue->next);
+                break;
+            }
+        case OBJ_ERROR:
+            {
+                ObjError* error = (ObjError*) object;
+                error->message = (ObjString*) forwardObject(compaction, (Obj*) error->message);
+                if (error->payload != NULL)
+                    forwardValue(compaction, error->payload);
+                break;
+            }
+        case OBJ_ARRAY:
+            {
+                ValueArray* values = &((ObjArray*) object)->values;
+                for (int i = 0; i < values->count; i++)
+                    forwardValue(compaction, &values->values[i]);
+                break;
+            }
+        case OBJ_DICT:
+            forwardMap(compaction, &((ObjDict*) object)->map);
+            break;
+        case OBJ_COROUTINE:
+            {
+                ObjCoroutine* coroutine = (ObjCoroutine*) object;
+                coroutine->closure = (ObjClosure*) forwardObject(compaction, (Obj*) coroutine->closure);
+                forwardFiber(compaction, &coroutine->fiber);
+                break;
+            }
+    }
+}
+
+#define page_object(page, word, bit) ((Obj*) ((char*) (page) + ((size_t) (word) * 64 + (bit)) * 8))
+
+static size_t objectBytes(SlabPage* page) {
+    size_t bytes = 0;
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1)
+            bytes += slabBlockSize(objectBlockSize(page_object(page, i, __builtin_ctzll(objects))));
+    }
+    return bytes;
+}
+
+static Obj* moveObject(Compaction* compaction, Obj* object) {
+    Collector* collector = compaction->collector;
+    size_t size = objectBlockSize(object);
+    Obj* moved = allocateMoved(compaction, size);
+    memcpy(moved, object, size);
+    slabSetObject(moved);
+    if (collector->sites != NULL)
+        moveAllocation(collector, object, moved);
+    // a moved string keeps its hash, and with it its slot
+    if (object->flags & OBJ_INTERNED)
+        stringSetReplace(&collector->interned, (ObjString*) object, (ObjString*) moved);
+    object->flags |= OBJ_MOVED;
+    forwarding(object) = moved;
+    compaction->moved |= page_bit(object);
+    return moved;
+}
+
+static void evacuatePage(Compaction* compaction, SlabPage* page) {
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1)
+            moveObject(compaction, page_object(page, i, __builtin_ctzll(objects)));
+    }
+}
+
+static void forwardRoots(Compaction* compaction) {
+    Collector* collector = compaction->collector;
+    VM* vm = collector->vm;
+    // the VM saved its registers into the running fiber, and reloads them from the forwarded one
+    forwardFiber(compaction, &vm->mainFiber);
+    vm->fiber = forwardFiberPointer(compaction, vm->fiber);
+    // the fibers that resumed the running one were written without barriers
+    for (Fiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller)
+        forwardFiber(compaction, fiber);
+    forwardMap(compaction, &vm->globals);
+    for (int i = 0; i < 256; i++)
+        collector->characters[i] = (ObjString*) forwardObject(compaction, (Obj*) collector->characters[i]);
+    for (int i = 0; i < vm->retained.count; i++)
+        forwardValue(compaction, &vm->retained.values[i]);
+    forwardEventLoop(compaction, &vm->loop);
+}
+
+void compactHeap(Collector* collector) {
+    Slabs* slabs = &collector->slabs;
+    // a swept heap holds live objects only, each of them old: no young or remembered object to forward
+    collectAll(collector);
+    collector->compactPending = 0;
+    slabCountFree(slabs);
+
+    // a page at most half full is emptied into the free blocks of the others, or into new pages
+    Compaction compaction = {.collector = collector, .count = 0, .moved = 0};
+    compaction.pages = (SlabPage**) malloc(sizeof(SlabPage*) * (slabs->pageCount + 1));
+    SlabPage* bump = slabBumpPage(slabs);
+    for (SlabPage* page = slabs->pages; page != NULL; page = page->next) {
+        if (page != bump && SLAB_PAGE_BODY - page->freeBytes <= SLAB_PAGE_BODY / 2)
+            compaction.pages[compaction.count++] = page;
+    }
+    if (compaction.count < 2) {
+        free(compaction.pages);
+        return;
+    }
+    qsort(compaction.pages, compaction.count, sizeof(SlabPage*), comparePages);
+    for (int i = 0; i < compaction.count; i++) {
+        SlabPage* page = compaction.pages[i];
+        page->evacuating = 1;
+        page->foreignBytes = SLAB_PAGE_BODY - page->freeBytes - objectBytes(page);
+    }
+    slabDropEvacuating(slabs);
+
+    for (int i = 0; i < compaction.count; i++)
+        evacuatePage(&compaction, compaction.pages[i]);
+    // the objects left in place and the moved copies; large objects are flat strings, which point nowhere
+    for (SlabPage* page = slabs->pages; page != NULL; page = page->next) {
+        if (page->evacuating)
+            continue;
+        for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+            for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1)
+                forwardFields(&compaction, page_object(page, i, __builtin_ctzll(objects)));
+        }
+    }
+    forwardRoots(&compaction);
+
+    for (int i = 0; i < compaction.count; i++) {
+        SlabPage* page = compaction.pages[i];
+        slabs->used -= SLAB_PAGE_BODY - page->freeBytes - page->foreignBytes;
+        page->evacuating = 0;
+        if (page->foreignBytes == 0) {
+            collector->releasedBytes += slabRelease(slabs, page);
+        } else {
+            // a block of an unknown owner pins its page, whose free blocks are lost to the free lists
+            memset(page->objects, 0, sizeof(page->objects));
+        }
+    }
+    free(compaction.pages);
+#ifdef __GLIBC__
+    // the buffers of arrays, maps and stacks come from malloc, which keeps their freed pages
+    malloc_trim(0);
+#endif
+    collector->compactions++;
+}
+
+static void pinPage(Obj* object) {
+    if (!(object->flags & (OBJ_OLD | OBJ_LARGE)))
+        slab_page(object)->pinned = 1;
+}
+
+// the values the host retained stay in place, as it may have copied them: so does every survivor
+// of their page
+void evacuateNursery(Collector* collector) {
+    Compaction compaction = {.collector = collector, .pages = NULL, .count = 0, .moved = 0};
+    for (int i = 0; i < collector->vm->retained.count; i++) {
+        if (is_obj(collector->vm->retained.values[i]))
+            pinPage(as_obj(collector->vm->retained.values[i]));
+    }
+
+    // the copies are promoted right away, unmarked
+    for (SlabPage* page = collector->slabs.nursery; page != NULL; page = page->next) {
+        if (page->pinned)
+            continue;
+        for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+            for (uint64_t live = page->objects[i] & page->marks[i]; live != 0; live &= live - 1)
+                moveObject(&compaction, page_object(page, i, __builtin_ctzll(live)))->flags |= OBJ_OLD;
+        }
+    }
+
+    // the survivors point to young objects, and so do the old objects and slots the barriers remembered
+    for (SlabPage* page = collector->slabs.nursery; page != NULL; page = page->next) {
+        for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+            for (uint64_t live = page->objects[i] & page->marks[i]; live != 0; live &= live - 1)
+                forwardFields(&compaction, forwardObject(&compaction, page_object(page, i, __builtin_ctzll(live))));
+        }
+    }
+    for (int i = 0; i < collector->rememberedCount; i++)
+        forwardFields(&compaction, collector->remembered[i]);
+    for (int i = 0; i < collector->slotCount; i++) {
+        int count;
+        Value* values = slotValues(&collector->slots[i], &count);
+        for (int j = 0; values != NULL && j < count; j++)
+            forwardValue(&compaction, &values[j]);
+    }
+    forwardRoots(&compaction);
+}
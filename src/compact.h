@@ -0,0 +1,19 @@
+#ifndef compact_h
+#define compact_h
+
+#include "./commontypes.h"
+#include "./datastructs/value.h"
+
+typedef struct sCompaction Compaction;
+
+// moves the objects of sparse slab pages into the other pages and gives the emptied ones back
+// to the system. Every pointer to a moved object is rewritten, so only the VM and the collector
+// may hold one: the VM compacts between the instructions of its outermost run, see vmCompact
+void compactHeap(Collector* collector);
+// copies the marked objects of the nursery into the slabs, as part of a minor collection
+void evacuateNursery(Collector* collector);
+// where the running compaction moved object, object itself if it stayed in place
+Obj* forwardObject(Compaction* compaction, Obj* object);
+void forwardValue(Compaction* compaction, Value* value);
+
+#endif
@@ -132,7 +132,7 @@ static void emitClosure(Compiler* compiler, Scope* scope, ObjFunction* function)
 }
 
 static void emitGlobalDecl(Compiler* compiler, Token identifier) {
-    ObjString* strname = copyString(compiler->collector, identifier.start, identifier.length);
+    ObjString* strname = copyInternedString(compiler->collector, identifier.start, identifier.length);
     Value name = to_vobj(strname);
     emit_addressable_at_current(compiler, OP_GLOBAL_DECL_LONG, OP_GLOBAL_DECL, name);
 }
@@ -222,6 +222,7 @@ static void emitUnary(Compiler* compiler, TokenType operator) {
         case TOK_PLUS: break; // NO_OP
         case TOK_MINUS: emitByte(compiler, OP_NEGATE); break;
         case TOK_EXCLAMATION_MARK: emitByte(compiler, OP_NOT); break;
+        default: break;
     }
 }
 
@@ -277,6 +278,7 @@ static void emitBinary(Compiler* compiler, TokenType operator) {
         case TOK_GREATER_EQUAL: emitByte(compiler, OP_GREATER_EQUAL); break;
         case TOK_PLUS_PLUS: emitByte(compiler, OP_CONCAT); break;
         case TOK_XOR: emitByte(compiler, OP_XOR); break;
+        default: break;
     }
 }
 
@@ -346,14 +348,14 @@ static void numberExpression(Compiler* compiler) {
 }
 
 static void stringExpression(Compiler* compiler) {
-    ObjString* string = copyString(compiler->collector, compiler->current.start + 1, compiler->current.length - 2);
+    ObjString* string = copyInternedString(compiler->collector, compiler->current.start + 1, compiler->current.length - 2);
     emitConstant(compiler, to_vobj(string));
     advance(compiler);
 }
 
 static void identifierExpression(Compiler* compiler, int canAssign) {
     Token identifier = compiler->current;
-    ObjString* strname = copyString(compiler->collector, identifier.start, identifier.length);
+    ObjString* strname = copyInternedString(compiler->collector, identifier.start, identifier.length);
     Value name = to_vobj(strname);
     advance(compiler);
     void (*emitGet)(Compiler*, Value, int) = NULL;
@@ -500,6 +502,7 @@ static void callExpression(Compiler* compiler, int canAssign) {
                     }
                     break;
                 }
+            default: break;
         }
     }        
 }
@@ -691,7 +694,7 @@ static void letStat(Compiler* compiler) {
 
 static void parseFunctionDeclaration(Compiler* compiler, Token name) {
     Scope scope;
-    pushScope(compiler, &scope, copyString(compiler->collector, name.start, name.length));
+    pushScope(compiler, &scope, copyInternedString(compiler->collector, name.start, name.length));
     startScope(compiler);
     eatError(compiler, TOK_LEFT_ROUND_BRACKET, "expected \"(\" before function parameters");
     if (!check(compiler, TOK_RIGHT_ROUND_BRACKET)) {
@@ -891,6 +894,25 @@ static void retStat(Compiler* compiler) {
         advance(compiler);
 }
 
+static void yieldStat(Compiler* compiler) {
+    if (compiler->scope->enclosing == NULL) {
+        errorAtCurrent(compiler, "cannot use \"yield\" outside of a function");
+        return;
+    }
+    // a function that yields runs as a coroutine
+    compiler->scope->function->isGenerator = 1;
+    advance(compiler);
+    if (check(compiler, TOK_NEW_LINE) || check(compiler, TOK_EOF))
+        emitByte(compiler, OP_CONST_NIHL);
+    else
+        expression(compiler);
+    emitByte(compiler, OP_YIELD);
+    if (!check(compiler, TOK_NEW_LINE) && !check(compiler, TOK_EOF))
+        errorAtCurrent(compiler, "unexpected token after yield statement");
+    else
+        advance(compiler);
+}
+
 static void statement(Compiler* compiler) {
     switch (currentTokenType(compiler)) {
         case TOK_LET:
@@ -920,6 +942,9 @@ static void statement(Compiler* compiler) {
         case TOK_CONTINUE:
             continueStat(compiler);
             break;
+        case TOK_YIELD:
+            yieldStat(compiler);
+            break;
         default:
             expressionStat(compiler);
             break;
@@ -938,6 +963,9 @@ ObjFunction* compile(Compiler* compiler, Collector* collector, char* source) {
     initCompiler(compiler);
     initLexer(&compiler->lexer, source);
     compiler->collector = collector;
+    // functions under construction are not rooted: don't collect while compiling
+    VM* vm = collector->vm;
+    collector->vm = NULL;
     Scope startingScope;
     startingScope.enclosing = NULL;
     initScope(compiler, &startingScope, NULL);
@@ -946,7 +974,9 @@ ObjFunction* compile(Compiler* compiler, Collector* collector, char* source) {
     advance(compiler);
     statementList(compiler);
     freeLexer(&compiler->lexer);
-    return !compiler->hadError ? popScope(compiler) : NULL;
+    ObjFunction* function = !compiler->hadError ? popScope(compiler) : NULL;
+    collector->vm = vm;
+    return function;
 }
 
 static void synchronize(Compiler* compiler) {
@@ -961,6 +991,7 @@ static void synchronize(Compiler* compiler) {
             case TOK_RET:
             case TOK_BREAK:
             case TOK_CONTINUE:
+            case TOK_YIELD:
                 break;
 
         }
@@ -9,7 +9,7 @@ typedef struct {
     TokenType type;
 } Keyword;
 
-static Keyword keywords[] = {
+static const Keyword keywords[] = {
     {"and", 3, TOK_AND},
     {"or", 2, TOK_OR},
     {"xor", 3, TOK_XOR},
@@ -26,6 +26,7 @@ static Keyword keywords[] = {
     {"nihl", 4, TOK_NIHL},
     {"break", 5, TOK_BREAK},
     {"continue", 8, TOK_CONTINUE},
+    {"yield", 5, TOK_YIELD},
     {NULL, 0, TOK_ERROR}
 };
 
@@ -162,7 +163,7 @@ static Token string(Lexer* lexer) {
 static Token identifier(Lexer* lexer) {
     while (!atEnd(lexer) && isNonStartIdChar(peek(lexer, 0)))
         advance(lexer);
-    for (Keyword* kw = keywords; kw->lexeme != NULL; kw++) {
+    for (const Keyword* kw = keywords; kw->lexeme != NULL; kw++) {
         if (kw->length == (int) (lexer->currentChar - lexer->beginningChar)
                 && memcmp(kw->lexeme, lexer->beginningChar, kw->length) == 0) {
             return makeToken(lexer, kw->type);
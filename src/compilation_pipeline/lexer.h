@@ -53,6 +53,7 @@ typedef enum {
     TOK_NIHL,
     TOK_BREAK,
     TOK_CONTINUE,
+    TOK_YIELD,
 
     // special
     TOK_INDENT,
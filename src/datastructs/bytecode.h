@@ -58,6 +58,7 @@ typedef enum {
     OP_ARRAY_LONG,
     OP_DICT,
     OP_DICT_LONG,
+    OP_YIELD,
 } OpCode;
 
 struct sBytecode {
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "hash_map.h"
+#include "../memory.h"
+
+typedef enum {
+    PACKET_STRING,
+    PACKET_ARRAY,
+    PACKET_DICT,
+    PACKET_CHANNEL,
+} PacketType;
+
+struct sPacket {
+    PacketType type;
+    Obj* unpacked; // object built by the receiver, so shared and cyclic references survive the trip
+    struct sPacket* next;
+    union {
+        struct {
+            char* chars;
+            int length;
+        } string;
+        ValueArray array; // the values are handed off, their header stays with the sender
+        struct {
+            Value* pairs; // keys and values, copied out of the entries of the sender
+            int count;
+        } dict;
+        Channel* channel;
+    } as;
+};
+
+typedef struct {
+    Collector* collector;
+    HashMap packed; // sender object -> its packet
+    Packet* packets;
+    size_t bytes;
+} Packer;
+
+// while in transit, the object slots of messages and of handed-off storage hold packets
+#define to_vpacket(packet) to_vobj((Obj*) (packet))
+#define as_packet(value) ((Packet*) as_obj(value))
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static Channel* registry = NULL;
+
+Channel* openChannel(const char* name) {
+    pthread_mutex_lock(&registryLock);
+    Channel* channel = registry;
+    while (channel != NULL && strcmp(channel->name, name) != 0)
+        channel = channel->next;
+    if (channel == NULL) {
+        channel = (Channel*) malloc(sizeof(Channel));
+        channel->name = strdup(name);
+        channel->refs = 0;
+        channel->closed = 0;
+        pthread_mutex_init(&channel->lock, NULL);
+        pthread_cond_init(&channel->ready, NULL);
+        channel->head = NULL;
+        channel->tail = NULL;
+        channel->next = registry;
+        registry = channel;
+    }
+    channel->refs++;
+    pthread_mutex_unlock(&registryLock);
+    return channel;
+}
+
+static void retainChannel(Channel* channel) {
+    pthread_mutex_lock(&registryLock);
+    channel->refs++;
+    pthread_mutex_unlock(&registryLock);
+}
+
+// called with the registry locked
+static void unregisterChannel(Channel* channel) {
+    Channel** link = &registry;
+    while (*link != channel)
+        link = &(*link)->next;
+    *link = channel->next;
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->ready);
+    free(channel->name);
+    free(channel);
+}
+
+void releaseChannel(Channel* channel) {
+    pthread_mutex_lock(&registryLock);
+    channel->refs--;
+    pthread_mutex_lock(&channel->lock);
+    int drained = channel->head == NULL;
+    pthread_mutex_unlock(&channel->lock);
+    // undelivered messages keep a channel registered until somebody opens it again
+    if (channel->refs == 0 && drained)
+        unregisterChannel(channel);
+    pthread_mutex_unlock(&registryLock);
+}
+
+// frees a message that was never unpacked, with what its packets own
+static void freeMessage(Message* message) {
+    Packet* packet = message->packets;
+    while (packet != NULL) {
+        Packet* next = packet->next;
+        switch (packet->type) {
+            case PACKET_STRING:
+                free(packet->as.string.chars);
+                break;
+            case PACKET_ARRAY:
+                free(packet->as.array.values);
+                break;
+            case PACKET_DICT:
+                free(packet->as.dict.pairs);
+                break;
+            case PACKET_CHANNEL:
+                releaseChannel(packet->as.channel);
+                break;
+        }
+        free(packet);
+        packet = next;
+    }
+    free(message);
+}
+
+void freeChannels(void) {
+    // a message may hold the last reference to another channel: free them one at a time
+    for (;;) {
+        pthread_mutex_lock(&registryLock);
+        Message* message = NULL;
+        for (Channel* channel = registry; channel != NULL && message == NULL; channel = channel->next) {
+            pthread_mutex_lock(&channel->lock);
+            message = channel->head;
+            if (message != NULL) {
+                channel->head = message->next;
+                if (channel->head == NULL)
+                    channel->tail = NULL;
+            }
+            pthread_mutex_unlock(&channel->lock);
+        }
+        pthread_mutex_unlock(&registryLock);
+        if (message == NULL)
+            break;
+        freeMessage(message);
+    }
+    pthread_mutex_lock(&registryLock);
+    Channel* channel = registry;
+    while (channel != NULL) {
+        Channel* next = channel->next;
+        if (channel->refs == 0)
+            unregisterChannel(channel);
+        channel = next;
+    }
+    pthread_mutex_unlock(&registryLock);
+}
+
+void channelClose(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = 1;
+    pthread_cond_broadcast(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+static int checkSendable(HashMap* visited, Value value, char** error) {
+    // strings are always sendable, and a rope could not be hashed without being flattened
+    if (!is_obj(value) || is_string(value))
+        return 1;
+    Value seen;
+    if (mapGet(visited, value, &seen))
+        return 1;
+    Obj* obj = as_obj(value);
+    switch (obj->type) {
+        case OBJ_STRING:
+        case OBJ_CHANNEL:
+            return 1;
+        case OBJ_ARRAY:
+            {
+                mapPut(NULL, visited, value, to_vnihl());
+                ValueArray* values = &((ObjArray*) obj)->values;
+                for (int i = 0; i < values->count; i++) {
+                    if (!checkSendable(visited, values->values[i], error))
+                        return 0;
+                }
+                return 1;
+            }
+        case OBJ_DICT:
+            {
+                mapPut(NULL, visited, value, to_vnihl());
+                HashMap* map = &((ObjDict*) obj)->map;
+                for (int i = 0; i < map->count; i++) {
+                    if (!checkSendable(visited, map->entries[i].key, error)
+                            || !checkSendable(visited, map->entries[i].value, error))
+                        return 0;
+                }
+                return 1;
+            }
+        default:
+            *error = "only numbers, booleans, nihl, strings, arrays, dictionaries and channels can be sent";
+            return 0;
+    }
+}
+
+// a rope is hashed by its characters, which nothing may be allocated to flatten while packing:
+// each reference to one is packed on its own, the other objects once
+static int packedOnce(Value value) {
+    return !is_string(value) || is_flat(as_string(value));
+}
+
+static Packet* newPacket(Packer* packer, Value value, PacketType type) {
+    Packet* packet = (Packet*) malloc(sizeof(Packet));
+    packet->type = type;
+    packet->unpacked = NULL;
+    packet->next = packer->packets;
+    packer->packets = packet;
+    if (packedOnce(value))
+        mapPut(NULL, &packer->packed, value, to_vpacket(packet));
+    return packet;
+}
+
+static Value packValue(Packer* packer, Value value) {
+    if (!is_obj(value))
+        return value;
+    Value packed;
+    if (packedOnce(value) && mapGet(&packer->packed, value, &packed))
+        return packed;
+    Obj* obj = as_obj(value);
+    Packet* packet = NULL;
+    switch (obj->type) {
+        case OBJ_STRING:
+            {
+                ObjString* string = (ObjString*) obj;
+                packet = newPacket(packer, value, PACKET_STRING);
+                packet->as.string.length = string->length;
+                // copied without flattening ropes: nothing may be allocated while packing
+                packet->as.string.chars = (char*) malloc(string->length + 1);
+                copyStringChars(string, packet->as.string.chars);
+                packet->as.string.chars[string->length] = '\0';
+                break;
+            }
+        case OBJ_CHANNEL:
+            {
+                packet = newPacket(packer, value, PACKET_CHANNEL);
+                packet->as.channel = ((ObjChannel*) obj)->channel;
+                retainChannel(packet->as.channel);
+                break;
+            }
+        case OBJ_ARRAY:
+            {
+                ObjArray* array = (ObjArray*) obj;
+                packet = newPacket(packer, value, PACKET_ARRAY);
+                ValueArray* values = &packet->as.array;
+                *values = array->values;
+                // the sender keeps an empty array
+                initValueArray(&array->values);
+                packer->bytes += sizeof(Value) * values->capacity;
+                for (int i = 0; i < values->count; i++)
+                    values->values[i] = packValue(packer, values->values[i]);
+                break;
+            }
+        case OBJ_DICT:
+            {
+                ObjDict* dict = (ObjDict*) obj;
+                packet = newPacket(packer, value, PACKET_DICT);
+                // identity keys hash by the address of their object in the sending heap: copy
+                // the entries out, to be hashed again by the receiver, and the sender keeps an
+                // empty dictionary
+                HashMap* map = &dict->map;
+                Value* pairs = (Value*) malloc(sizeof(Value) * 2 * (map->count + 1));
+                int count = map->count;
+                for (int i = 0; i < count; i++) {
+                    pairs[2 * i] = map->entries[i].key;
+                    pairs[2 * i + 1] = map->entries[i].value;
+                }
+                freeMap(packer->collector, map);
+                initMap(map);
+                packet->as.dict.pairs = pairs;
+                packet->as.dict.count = count;
+                for (int i = 0; i < 2 * count; i++)
+                    pairs[i] = packValue(packer, pairs[i]);
+                break;
+            }
+        default:
+            break; // excluded by checkSendable
+    }
+    return to_vpacket(packet);
+}
+
+int channelSend(Collector* collector, Channel* channel, Value value, char** error) {
+    HashMap visited;
+    initMap(&visited);
+    int sendable = checkSendable(&visited, value, error);
+    freeMap(NULL, &visited);
+    if (!sendable)
+        return 0;
+    pthread_mutex_lock(&channel->lock);
+    int closed = channel->closed;
+    pthread_mutex_unlock(&channel->lock);
+    if (closed) {
+        *error = "cannot send to a closed channel";
+        return 0;
+    }
+
+    // containers are detached from the heap while they are packed: don't collect meanwhile
+    VM* vm = collector->vm;
+    collector->vm = NULL;
+    Packer packer;
+    packer.collector = collector;
+    initMap(&packer.packed);
+    packer.packets = NULL;
+    packer.bytes = 0;
+    Message* message = (Message*) malloc(sizeof(Message));
+    message->value = packValue(&packer, value);
+    message->packets = packer.packets;
+    message->bytes = packer.bytes;
+    message->next = NULL;
+    freeMap(NULL, &packer.packed);
+    collector->allocatedBytes -= packer.bytes;
+    collector->vm = vm;
+
+    pthread_mutex_lock(&channel->lock);
+    // the channel may have been closed while the value was packed
+    closed = channel->closed;
+    if (!closed) {
+        if (channel->tail == NULL)
+            channel->head = message;
+        else
+            channel->tail->next = message;
+        channel->tail = message;
+        pthread_cond_signal(&channel->ready);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if (closed) {
+        freeMessage(message);
+        *error = "cannot send to a closed channel";
+        return 0;
+    }
+    return 1;
+}
+
+static Value unpackValue(Collector* collector, Value value) {
+    if (!is_obj(value))
+        return value;
+    Packet* packet = as_packet(value);
+    if (packet->unpacked != NULL)
+        return to_vobj(packet->unpacked);
+    switch (packet->type) {
+        case PACKET_STRING:
+            {
+                // the characters are copied into the receiving heap
+                packet->unpacked = (Obj*) copyString(collector, packet->as.string.chars, packet->as.string.length);
+                free(packet->as.string.chars);
+                break;
+            }
+        case PACKET_CHANNEL:
+            {
+                // the object takes over the reference held by the message
+                packet->unpacked = (Obj*) newChannel(collector, packet->as.channel);
+                break;
+            }
+        case PACKET_ARRAY:
+            {
+                ObjArray* array = newArray(collector);
+                ValueArray* values = &array->values;
+                *values = packet->as.array;
+                packet->unpacked = (Obj*) array;
+                for (int i = 0; i < values->count; i++)
+                    values->values[i] = unpackValue(collector, values->values[i]);
+                break;
+            }
+        case PACKET_DICT:
+            {
+                ObjDict* dict = newDict(collector);
+                packet->unpacked = (Obj*) dict;
+                // the entries are rebuilt in the receiving heap, hashing its own objects
+                Value* pairs = packet->as.dict.pairs;
+                for (int i = 0; i < packet->as.dict.count; i++) {
+                    Value key = unpackValue(collector, pairs[2 * i]);
+                    Value entryValue = unpackValue(collector, pairs[2 * i + 1]);
+                    if (is_string(key))
+                        key = to_vobj(internString(collector, as_string(key)));
+                    mapPut(collector, &dict->map, key, entryValue);
+                }
+                free(pairs);
+                break;
+            }
+    }
+    return to_vobj(packet->unpacked);
+}
+
+int channelReceive(Collector* collector, Channel* channel, Value* result) {
+    pthread_mutex_lock(&channel->lock);
+    while (channel->head == NULL && !channel->closed)
+        pthread_cond_wait(&channel->ready, &channel->lock);
+    Message* message = channel->head;
+    if (message != NULL) {
+        channel->head = message->next;
+        if (channel->head == NULL)
+            channel->tail = NULL;
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if (message == NULL) // closed and drained
+        return 0;
+
+    // containers hold packets until they are unpacked: don't collect meanwhile
+    VM* vm = collector->vm;
+    collector->vm = NULL;
+    collector->allocatedBytes += message->bytes;
+    *result = unpackValue(collector, message->value);
+    collector->vm = vm;
+
+    Packet* packet = message->packets;
+    while (packet != NULL) {
+        Packet* next = packet->next;
+        free(packet);
+        packet = next;
+    }
+    free(message);
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef channel_h
+#define channel_h
+
+#include <pthread.h>
+
+#include "value.h"
+
+// Channels move values between VMs running on different threads. A message
+// lives outside of every heap: numbers, booleans and nihl travel as they are,
+// strings are copied once into the message and adopted by the receiving heap,
+// the values of arrays are handed off to the receiver and the entries of dicts
+// are copied (the sent containers are left empty in the sender).
+
+typedef struct sPacket Packet;
+typedef struct sMessage Message;
+
+struct sMessage {
+    Value value;
+    Packet* packets; // every packet of the message, to free them once unpacked
+    size_t bytes; // storage handed off from the sending heap
+    struct sMessage* next;
+};
+
+struct sChannel {
+    char* name;
+    int refs;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Message* head;
+    Message* tail;
+    struct sChannel* next;
+};
+
+Channel* openChannel(const char* name);
+void releaseChannel(Channel* channel);
+int channelSend(Collector* collector, Channel* channel, Value value, char** error);
+int channelReceive(Collector* collector, Channel* channel, Value* result);
+void channelClose(Channel* channel);
+// frees the channels and the messages left undelivered, once no VM is running
+void freeChannels(void);
+
+#endif
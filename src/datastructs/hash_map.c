@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "hash_map.h"
 #include "value_operations.h"
@@ -6,177 +9,181 @@
 #include "../util.h"
 #include "../debug/debug_switches.h"
 
-#define LOAD_FACTOR 0.65 
-#define get_index(hash, capacity) ((hash) & ((capacity) - 1))
+// entries are appended to a dense array, which keeps their insertion order and is what iteration
+// walks. The slots of an index point into it: open addressing over groups of 16 slots, whose
+// control bytes are compared with the low 7 bits of a hash at once, so that only the entries of
+// the slots they match have their key compared. Maps of a few keys have no index: their entries
+// are compared in order, which costs less than probing and saves the memory of a group
+#define LINEAR_KEYS 8
+#define GROUP_SIZE 16
+#define CONTROL_EMPTY 0x80
+// slots taken before the index is rebuilt: at least one in eight stays empty to end probes
+#define max_used(capacity) ((capacity) - (capacity) / 8)
+#define hash_group(hash) ((hash) >> 7)
+#define hash_control(hash) ((uint8_t) ((hash) & 0x7f))
+#define index_bytes(capacity) ((size_t) (capacity) * (sizeof(uint32_t) + 1))
+
+typedef uint32_t GroupMask; // bit i stands for slot i of a group
+
+static inline GroupMask matchControl(const uint8_t* group, uint8_t control) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) control)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (GroupMask) (group[i] == control) << i;
+    return mask;
+#endif
+}
+
+// empty slots, whose control bytes have their high bit set
+static inline GroupMask matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (GroupMask) (group[i] >> 7) << i;
+    return mask;
+#endif
+}
 
-static void freeEntries(Collector* collector, Entry** entries, int capacity) {
-    for (int i = 0; i < capacity; i++) {
-        Entry* entry = entries[i];
-        while (entry != NULL) {
-            Entry* toFree = entry;
-            entry = entry->next;
-            free_pointer(collector, toFree, sizeof(Entry));
+// groups are probed at triangular steps, which visit each of them once as their count is a power of two
+#define next_group(group, step, groups) (((group) + (step)) & ((groups) - 1))
+
+static int findSlot(struct sHashMap* map, Value key, uint32_t hash) {
+    size_t groups = map->capacity / GROUP_SIZE;
+    size_t group = hash_group(hash) & (groups - 1);
+    for (size_t step = 1;; step++) {
+        uint8_t* control = map->control + group * GROUP_SIZE;
+        for (GroupMask match = matchControl(control, hash_control(hash)); match != 0; match &= match - 1) {
+            int slot = group * GROUP_SIZE + __builtin_ctz(match);
+            if (valuesEqual(key, map->entries[map->index[slot]].key))
+                return slot;
         }
+        if (matchControl(control, CONTROL_EMPTY) != 0)
+            return -1;
+        group = next_group(group, step, groups);
     }
-    free_array(collector, Entry*, entries, capacity);
 }
 
-static Entry* findEntry(Entry** entries, int capacity, Value key) {
-    if (entries == NULL)
-        return NULL;
-    uint32_t hash = get_value_hash(key);
-    Entry* head = entries[get_index(hash, capacity)];
-    while (head != NULL) {
-        if (valuesEqual(key, head->key)) {
-            return head;
+// the entry holding key, -1 if there is none
+static int findEntry(struct sHashMap* map, Value key) {
+    if (map->capacity == 0) {
+        for (int i = 0; i < map->count; i++) {
+            if (valuesEqual(key, map->entries[i].key))
+                return i;
         }
-        head = head->next;
+        return -1;
     }
-    return NULL;
+    int slot = findSlot(map, key, get_value_hash(key));
+    return slot < 0 ? -1 : (int) map->index[slot];
 }
 
-static int entriesPut(Collector* collector, Entry** entries, int capacity, Value key, Value value) {
-    Entry* head = findEntry(entries, capacity, key);
-    if (head == NULL) {
-        uint32_t hash = get_value_hash(key);
-        int index = get_index(hash, capacity);
-        Entry* newhead = allocate_pointer(collector, Entry, sizeof(Entry));
-        newhead->key = key;
-        newhead->value = value;
-        newhead->next = entries[index];
-        entries[index] = newhead;
-        return 0;
-    } else {
-        head->value = value;
-        return 1;
+// the first slot a new key with this hash may take
+static int findFree(struct sHashMap* map, uint32_t hash) {
+    size_t groups = map->capacity / GROUP_SIZE;
+    size_t group = hash_group(hash) & (groups - 1);
+    for (size_t step = 1;; step++) {
+        GroupMask free = matchFree(map->control + group * GROUP_SIZE);
+        if (free != 0)
+            return group * GROUP_SIZE + __builtin_ctz(free);
+        group = next_group(group, step, groups);
     }
 }
 
-static void growMap(Collector* collector, struct sHashMap* map) {
-    int newcap = compute_capacity(map->capacity);
-    Entry** newentries = allocate_block(collector, Entry*, newcap);
-    for (int i = 0; i < newcap; i++) {
-        newentries[i] = NULL;
-    }
-    for (int i = 0; i < map->capacity; i++) {
-        Entry* head = map->entries[i];
-        while (head != NULL) {
-            entriesPut(collector, newentries, newcap, head->key, head->value);
-            head = head->next;
-        }
+static void fillSlot(struct sHashMap* map, int slot, uint32_t hash, int entry) {
+    map->control[slot] = hash_control(hash);
+    map->index[slot] = entry;
+}
+
+// room for count entries: exactly that many without an index, then half as many again, up to what
+// the index can point to before it is rebuilt
+static int entryCapacity(int count, int capacity) {
+    if (capacity == 0)
+        return count;
+    int wanted = count + count / 2;
+    return wanted < max_used(capacity) ? wanted : max_used(capacity);
+}
+
+// builds the index twice as large, or a first one for a map past its linear keys
+static void resizeMap(Collector* collector, struct sHashMap* map) {
+    int capacity = map->capacity == 0 ? GROUP_SIZE : map->capacity * 2;
+    uint32_t* index = (uint32_t*) reallocate(collector, NULL, 0, index_bytes(capacity));
+    reallocate(collector, map->index, index_bytes(map->capacity), 0);
+    map->index = index;
+    map->control = (uint8_t*) (index + capacity);
+    map->capacity = capacity;
+    memset(map->control, CONTROL_EMPTY, capacity);
+    for (int i = 0; i < map->count; i++) {
+        uint32_t hash = get_value_hash(map->entries[i].key);
+        fillSlot(map, findFree(map, hash), hash, i);
     }
-    freeEntries(collector, map->entries, map->capacity);
-    map->entries = newentries;
-    map->capacity = newcap;
 }
 
 void initMap(struct sHashMap* map) {
     map->entries = NULL;
-    map->count = 0;
+    map->index = NULL;
+    map->control = NULL;
     map->capacity = 0;
+    map->entryCapacity = 0;
+    map->count = 0;
 }
 
 int mapPut(Collector* collector, struct sHashMap* map, Value key, Value value) {
-    if (map->count + 1 > map->capacity * LOAD_FACTOR) {
-        growMap(collector, map);
-    }
-    int result = entriesPut(collector, map->entries, map->capacity, key, value);
-    if (!result)
-        map->count++;
-    return result;
+    int entry;
+    return mapPutAt(collector, map, key, value, &entry);
 }
 
-int mapGet(struct sHashMap* map, Value key, Value* result) {
-    Entry* entry = findEntry(map->entries, map->capacity, key);
-    if (entry == NULL) {
-        return 0;
+int mapPutAt(Collector* collector, struct sHashMap* map, Value key, Value value, int* entry) {
+    int found = findEntry(map, key);
+    if (found >= 0) {
+        *entry = found;
+        map->entries[found].value = value;
+        return 1;
     }
-    *result = entry->value;
-    return 1;
+    if (map->capacity == 0 ? map->count == LINEAR_KEYS : map->count + 1 > max_used(map->capacity))
+        resizeMap(collector, map);
+    if (map->count == map->entryCapacity) {
+        // the index holds positions, which stay valid as the entries move
+        int entries = entryCapacity(map->count + 1, map->capacity);
+        map->entries = grow_array(collector, Entry, map->entries, map->entryCapacity, entries);
+        map->entryCapacity = entries;
+    }
+    if (map->capacity > 0) {
+        uint32_t hash = get_value_hash(key);
+        fillSlot(map, findFree(map, hash), hash, map->count);
+    }
+    *entry = map->count;
+    map->entries[map->count].key = key;
+    map->entries[map->count].value = value;
+    map->count++;
+    return 0;
 }
 
-int mapRemove(Collector* collector, struct sHashMap* map, Value key) {
-    if (map->count == 0)
+int mapGet(struct sHashMap* map, Value key, Value* result) {
+    int found = findEntry(map, key);
+    if (found < 0)
         return 0;
-    uint32_t hash = get_value_hash(key);
-    int index = get_index(hash, map->capacity);
-    Entry* dummy = (Entry*) malloc(sizeof(Entry));
-    Entry* previous = dummy;
-    Entry* current = map->entries[index];
-    previous->next = current;
-
-    while (current != NULL) {
-        if (valuesEqual(current->key, key)) {
-            previous->next = current->next;
-            map->entries[index] = dummy->next;
-            free(dummy);
-            free_pointer(collector, current, sizeof(Entry));
-            return 1;
-        }
-        previous = current;
-        current = current->next;
-    }
-
-    free(dummy);
-    return 0;
+    *result = map->entries[found].value;
+    return 1;
 }
 
 void freeMap(Collector* collector, struct sHashMap* map) {
-    freeEntries(collector, map->entries, map->capacity);
+    free_array(collector, Entry, map->entries, map->entryCapacity);
+    reallocate(collector, map->index, index_bytes(map->capacity), 0);
     initMap(map);
 }
 
-ObjString* containsStringDeepEqual(struct sHashMap* map, char* chars, int length) {
-    if (map->count == 0)
-        return NULL;
-    uint32_t hash = hash_string(chars, length);
-    int index = get_index(hash, map->capacity);
-    Entry* head = map->entries[index];
-    while (head != NULL) {
-        Value key = head->key;
-        if (!is_string(key)) 
-            continue;
-        ObjString* objString = as_string(head->key);
-        if (objString->length == length && memcmp(chars, objString->chars, length) == 0)
-            return objString;
-        head = head->next;
-    }
-    return NULL;
+size_t mapBytes(struct sHashMap* map) {
+    return sizeof(Entry) * map->entryCapacity + index_bytes(map->capacity);
 }
 
 void markMap(Collector* collector, struct sHashMap* map) {
-    for (int i = 0; i < map->capacity; i++) {
-        Entry* entry = map->entries[i];
-        if (entry != NULL) {
-            // mark inner linked list
-            while (entry != NULL) {
-                // mark each entry in linked list
-                markValue(collector, entry->key);
-                markValue(collector, entry->value);
-                entry = entry->next;
-            }
-        }
-    }
-}
-
-void removeUnmarkedKeys(Collector* collector, struct sHashMap* map) {
-    Entry* dummy = (Entry*) malloc(sizeof(Entry));
-    for (int i = 0; i < map->capacity; i++) {
-        dummy->next = map->entries[i];
-        Entry* previous = dummy;
-        Entry* current = map->entries[i];
-        while (current != NULL) {
-            if (is_obj(current->key) && !as_obj(current->key)->marked) {
-                previous->next = current->next;
-                free_pointer(collector, current, sizeof(Entry));
-                current = previous->next;
-            } else { 
-                previous = previous->next;
-                if (current != NULL)
-                    current = current->next;
-            }
-        }
-        map->entries[i] = dummy->next;
+    for (int i = 0; i < map->count; i++) {
+        Entry* entry = &map->entries[i];
+        markValue(collector, entry->key);
+        markValue(collector, entry->value);
     }
-    free(dummy);
 }
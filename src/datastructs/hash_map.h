@@ -7,24 +7,17 @@
 struct sEntry {
     Value key;
     Value value;
-    struct sEntry* next;
 };
 
 typedef struct sEntry Entry;
 
-struct sHashMap {
-    Entry** entries;
-    int capacity;
-    int count;
-};
-
 void initMap(struct sHashMap* map);
 int mapPut(Collector* collector, struct sHashMap* map, Value key, Value value);
+// the same, telling which entry now holds the key
+int mapPutAt(Collector* collector, struct sHashMap* map, Value key, Value value, int* entry);
 int mapGet(struct sHashMap* map, Value key, Value* result);
-int mapRemove(Collector* collector, struct sHashMap* map, Value key);
-ObjString* containsStringDeepEqual(struct sHashMap* map, char* chars, int length);
 void freeMap(Collector* collector, struct sHashMap* map);
 void markMap(Collector* collector, struct sHashMap* map);
-void removeUnmarkedKeys(Collector* collector, struct sHashMap* map);
+size_t mapBytes(struct sHashMap* map);
 
 #endif
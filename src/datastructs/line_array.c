@@ -24,7 +24,7 @@ int writeLineArray(Collector* collector, LineArray* linearr, int line) {
 }
 
 void freeLineArray(Collector* collector, LineArray* linearr) {
-    free_array(collector, int, linearr->lines, linearr->capacity);
+    free_array(collector, LineData, linearr->lines, linearr->capacity);
     initLineArray(linearr);
 }
 
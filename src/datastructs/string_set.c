@@ -0,0 +1,96 @@
+#include "string_set.h"
+#include "../memory.h"
+#include "../util.h"
+
+// slots full or removed before the table is rebuilt: most lookups miss, and every full slot a
+// miss probes reads the string it points to
+#define max_used(capacity) ((capacity) / 2)
+#define string_hash(string) (((Obj*) (string))->hash)
+
+void initStringSet(StringSet* set) {
+    set->strings = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    set->tombstones = 0;
+}
+
+void freeStringSet(Collector* collector, StringSet* set) {
+    free_array(collector, ObjString*, set->strings, set->capacity);
+    initStringSet(set);
+}
+
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash) {
+    if (set->count == 0)
+        return NULL;
+    int mask = set->capacity - 1;
+    for (int slot = hash & mask;; slot = (slot + 1) & mask) {
+        ObjString* string = set->strings[slot];
+        if (string == NULL)
+            return NULL;
+        if (string != STRING_SET_TOMBSTONE && string_hash(string) == hash && string->length == length
+                && memcmp(string->chars, chars, length) == 0)
+            return string;
+    }
+}
+
+static void insertString(StringSet* set, ObjString* string) {
+    int mask = set->capacity - 1;
+    int slot = string_hash(string) & mask;
+    while (string_set_slot_full(set, slot))
+        slot = (slot + 1) & mask;
+    if (set->strings[slot] == STRING_SET_TOMBSTONE)
+        set->tombstones--;
+    set->strings[slot] = string;
+    set->count++;
+}
+
+// rebuilds the table without its tombstones, twice as large if the strings fill a quarter of it
+static void resizeSet(Collector* collector, StringSet* set) {
+    int capacity = set->capacity == 0 ? 16
+        : (set->count + 1 > set->capacity / 4 ? set->capacity * 2 : set->capacity);
+    // allocate before reading the old table: a collection triggered here sweeps strings out of it
+    ObjString** strings = allocate_block(collector, ObjString*, capacity);
+    StringSet rebuilt = {.strings = strings, .capacity = capacity, .count = 0, .tombstones = 0};
+    memset(strings, 0, sizeof(ObjString*) * capacity);
+    for (int i = 0; i < set->capacity; i++) {
+        if (string_set_slot_full(set, i))
+            insertString(&rebuilt, set->strings[i]);
+    }
+    freeStringSet(collector, set);
+    *set = rebuilt;
+}
+
+void stringSetAdd(Collector* collector, StringSet* set, ObjString* string) {
+    if (set->count + set->tombstones + 1 > max_used(set->capacity))
+        resizeSet(collector, set);
+    insertString(set, string);
+}
+
+void stringSetRemove(StringSet* set, ObjString* string) {
+    if (set->count == 0)
+        return;
+    int mask = set->capacity - 1;
+    for (int slot = string_hash(string) & mask; set->strings[slot] != NULL; slot = (slot + 1) & mask) {
+        if (set->strings[slot] == string) {
+            // the next slot ends every probe that reaches this one when it is empty
+            if (set->strings[(slot + 1) & mask] == NULL) {
+                set->strings[slot] = NULL;
+            } else {
+                set->strings[slot] = STRING_SET_TOMBSTONE;
+                set->tombstones++;
+            }
+            set->count--;
+            return;
+        }
+    }
+}
+
+void stringSetReplace(StringSet* set, ObjString* string, ObjString* moved) {
+    int mask = set->capacity - 1;
+    for (int slot = string_hash(string) & mask; set->strings[slot] != NULL; slot = (slot + 1) & mask) {
+        if (set->strings[slot] == string) {
+            set->strings[slot] = moved;
+            return;
+        }
+    }
+}
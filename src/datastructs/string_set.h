@@ -0,0 +1,29 @@
+#ifndef string_set_h
+#define string_set_h
+
+#include "value.h"
+#include "../commontypes.h"
+
+// the interned strings: open addressing over the strings themselves, compared by hash, length
+// and characters. The strings are weak, the sweeper removes them as it frees them
+typedef struct {
+    ObjString** strings; // NULL for an empty slot
+    int capacity; // a power of two, or 0
+    int count;
+    int tombstones; // removed slots, which probes go past
+} StringSet;
+
+// marks a removed slot
+#define STRING_SET_TOMBSTONE ((ObjString*) 1)
+#define string_set_slot_full(set, slot) ((uintptr_t) (set)->strings[slot] > 1)
+
+void initStringSet(StringSet* set);
+void freeStringSet(Collector* collector, StringSet* set);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash);
+// string must not be in the set yet, and its hash set
+void stringSetAdd(Collector* collector, StringSet* set, ObjString* string);
+void stringSetRemove(StringSet* set, ObjString* string);
+// the slot of string, which moved and kept its hash, now holds moved
+void stringSetReplace(StringSet* set, ObjString* string, ObjString* moved);
+
+#endif
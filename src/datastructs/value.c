@@ -2,8 +2,11 @@
 #include "../memory.h"
 #include "../util.h"
 #include "bytecode.h"
+#include "channel.h"
 #include "../debug/debug_switches.h"
 
+uint64_t hashSeed = 0;
+
 #ifdef TRACE_GC
 static inline char* string_type(ObjType type) {
 #define type_case(type) case type: return #type;
@@ -15,6 +18,8 @@ static inline char* string_type(ObjType type) {
             type_case(OBJ_ARRAY)
             type_case(OBJ_DICT)
             type_case(OBJ_ERROR)
+            type_case(OBJ_CHANNEL)
+            type_case(OBJ_COROUTINE)
     }
 #undef type_case
 }
@@ -23,63 +28,160 @@ static inline char* string_type(ObjType type) {
 #define allocate_obj(collector, type, typeenum) \
     ((type*) allocateObj(collector, typeenum, sizeof(type)))
 
+// only strings may outgrow the slabs, whose pages carry the mark bits of the other objects
+_Static_assert(sizeof(ObjCoroutine) <= SLAB_MAX_SIZE, "objects are slab blocks");
+_Static_assert(sizeof(Obj) == 8, "object headers take 8 bytes");
+
 Obj* allocateObj(Collector* collector, ObjType type, size_t size) {
 #ifdef TRACE_OBJECT_LIST
     printf("OBJLIST\n");
-    for (Obj* o = collector->objects; o != NULL; o = o->next) {
-        dumpObj(o);
+    for (int i = 0; i < collector->youngCount; i++) {
+        dumpObj(collector->young[i]);
         printf(", ");
     }
     printf("\n");
 #endif
-    Obj* obj = allocate_pointer(collector, Obj, size);
+    Obj* obj = size > SLAB_MAX_SIZE ? allocate_pointer(collector, Obj, size) : allocateYoung(collector, size);
     obj->type = type;
-    obj->next = collector->objects;
-    collector->objects = obj;
-    obj->hash = hash_pointer(obj);
+    obj->flags = size > SLAB_MAX_SIZE ? OBJ_LARGE : 0;
     obj->marked = 0;
+    // the young objects of the nursery are found through its pages
+    if (obj->flags & OBJ_LARGE)
+        addYoung(collector, obj);
+    else
+        slabSetObject(obj);
+    if (collector->sites != NULL)
+        recordAllocation(collector, obj);
 #ifdef TRACE_GC
     printf("(pointer %p) alloc %ld bytes for %s object type\n", (void*)obj, size, string_type(type));
 #endif
     return obj;
 }
 
+static ObjString* flattenedOrSelf(ObjString* string) {
+    if (is_rope(string) && ((ObjRope*) string)->right == NULL)
+        return ((ObjRope*) string)->left;
+    return string;
+}
+
+ObjString* newString(Collector* collector, int length) {
+    // the characters follow the header in the same block
+    ObjString* string = (ObjString*) allocateObj(collector, OBJ_STRING, sizeof(ObjString) + length + 1);
+    string->chars[length] = '\0';
+    string->length = length;
+    return string;
+}
+
 ObjString* copyString(Collector* collector, char* chars, int length) {
+    ObjString* string = newString(collector, length);
+    memcpy(string->chars, chars, length);
+    return string;
+}
+
+ObjString* copyInternedString(Collector* collector, char* chars, int length) {
+    uint32_t hash = hash_string(chars, length);
     ObjString* str;
-    if ((str = containsStringDeepEqual(&collector->interned, chars, length)) != NULL) {
+    if ((str = stringSetFind(&collector->interned, chars, length, hash)) != NULL) {
+        reviveObject(collector, (Obj*) str);
         return str;
     }
-    char* copied = allocate_block(collector, char, length + 1);
-    memcpy(copied, chars, length);
-    copied[length] = '\0';
-    return takeString(collector, copied, length);
+    ObjString* string = copyString(collector, chars, length);
+    ((Obj*) string)->hash = hash;
+    ((Obj*) string)->flags |= OBJ_HASHED | OBJ_INTERNED;
+    pushSafe(collector, to_vobj(string));
+    stringSetAdd(collector, &collector->interned, string);
+    popSafe(collector);
+    return string;
 }
 
-ObjString* copyNoLengthString(Collector* collector, char* chars) {
-    return copyString(collector, chars, strlen(chars));
+void internCharacters(Collector* collector) {
+    for (int i = 0; i < 256; i++) {
+        char c = (char) i;
+        collector->characters[i] = copyInternedString(collector, &c, 1);
+    }
 }
 
-ObjString* takeString(Collector* collector, char* chars, int length) {
+ObjString* internString(Collector* collector, ObjString* string) {
+    string = flattenString(collector, string);
+    Obj* object = (Obj*) string;
+    if (object->flags & OBJ_INTERNED)
+        return string;
     ObjString* str;
-    if ((str = containsStringDeepEqual(&collector->interned, chars, length)) != NULL) {
-        free_block(collector, char, chars, length);
+    if ((str = stringSetFind(&collector->interned, string->chars, string->length, hashObject(object))) != NULL) {
+        reviveObject(collector, (Obj*) str);
         return str;
     }
-    ObjString* string = allocate_obj(collector, ObjString, OBJ_STRING);
-    string->chars = chars;
-    string->length = length;
-    ((Obj*) string)->hash = hash_string(chars, length);
+    object->flags |= OBJ_INTERNED;
     pushSafe(collector, to_vobj(string));
-    mapPut(collector, &collector->interned, to_vobj(string), to_vnihl());
+    stringSetAdd(collector, &collector->interned, string);
     popSafe(collector);
     return string;
 }
 
+ObjString* newRope(Collector* collector, ObjString* left, ObjString* right) {
+    ObjRope* rope = (ObjRope*) allocateObj(collector, OBJ_STRING, sizeof(ObjRope));
+    ((Obj*) rope)->flags |= OBJ_ROPE;
+    rope->length = left->length + right->length;
+    // a flattened rope is left for its flat string, which the nodes above it then share
+    rope->left = flattenedOrSelf(left);
+    rope->right = flattenedOrSelf(right);
+    write_barrier(collector, rope, to_vobj(rope->left));
+    write_barrier(collector, rope, to_vobj(rope->right));
+    return (ObjString*) rope;
+}
+
+ObjString* flattenString(Collector* collector, ObjString* string) {
+    if (!is_rope(string))
+        return string;
+    ObjRope* rope = (ObjRope*) string;
+    if (rope->right == NULL)
+        return rope->left;
+    ObjString* flat = newString(collector, rope->length);
+    copyStringChars(string, flat->chars);
+    // the children may now die, unless other strings share them
+    rope->left = flat;
+    rope->right = NULL;
+    write_barrier(collector, rope, to_vobj(flat));
+    return flat;
+}
+
+// fills out from its end, walking right children and stacking left ones: the ropes of a loop
+// appending to a string lean left, and keep the stack short
+void copyStringChars(ObjString* string, char* out) {
+    char* end = out + string->length;
+    ObjString** stack = NULL;
+    int count = 0;
+    int capacity = 0;
+    for (;;) {
+        if (is_rope(string) && ((ObjRope*) string)->right != NULL) {
+            if (count == capacity) {
+                capacity = compute_capacity(capacity);
+                stack = (ObjString**) realloc(stack, sizeof(ObjString*) * capacity);
+            }
+            stack[count++] = ((ObjRope*) string)->left;
+            string = ((ObjRope*) string)->right;
+            continue;
+        }
+        string = flattenedOrSelf(string);
+        end -= string->length;
+        memcpy(end, string->chars, string->length);
+        if (count == 0)
+            break;
+        string = stack[--count];
+    }
+    free(stack);
+}
+
+ObjString* copyNoLengthString(Collector* collector, char* chars) {
+    return copyString(collector, chars, strlen(chars));
+}
+
 ObjFunction* newFunction(Collector* collector) {
     ObjFunction* function = allocate_obj(collector, ObjFunction, OBJ_FUNCTION);
     function->name = NULL;
     function->arity = 0;
     function->upvalueCount = 0;
+    function->isGenerator = 0;
     pushSafe(collector, to_vobj(function));
     function->bytecode = allocate_pointer(collector, Bytecode, sizeof(Bytecode));
     popSafe(collector);
@@ -88,7 +190,7 @@ ObjFunction* newFunction(Collector* collector) {
 }
 
 ObjNativeFunction* newNativeFunction(Collector* collector, int arity, char* nameChars, CNativeFunction cfunction) {
-    ObjString* name = copyNoLengthString(collector, nameChars);
+    ObjString* name = copyInternedString(collector, nameChars, strlen(nameChars));
     pushSafeObj(collector, name);
     ObjNativeFunction* native = allocate_obj(collector, ObjNativeFunction, OBJ_NATIVE_FUNCTION);
     popSafe(collector);
@@ -114,22 +216,19 @@ ObjUpvalue* newUpvalue(Collector* collector, Value* value) {
     upvalue->value = value;
     upvalue->next = NULL;
     upvalue->closed = NULL;
+    upvalue->stackOwner = NULL;
     return upvalue;
 }
 
 ObjArray* newArray(Collector* collector) {
-    ValueArray* values = allocate_pointer(collector, ValueArray, sizeof(ValueArray));
-    initValueArray(values);
     ObjArray* array = allocate_obj(collector, ObjArray, OBJ_ARRAY);
-    array->values = values;
+    initValueArray(&array->values);
     return array;
 }
 
 ObjDict* newDict(Collector* collector) {
-    HashMap* map = allocate_pointer(collector, HashMap, sizeof(HashMap));
-    initMap(map);
     ObjDict* dict = allocate_obj(collector, ObjDict, OBJ_DICT);
-    dict->map = map;
+    initMap(&dict->map);
     return dict;
 }
 
@@ -152,10 +251,117 @@ ObjError* newErrorFromCharArray(Collector* collector, char* message) {
     return newErrorSafe(collector, strmsg);
 }
 
-void closeUpvalue(ObjUpvalue* upvalue) {
-    upvalue->closed = allocate_pointer(NULL, Value, sizeof(Value));
+// takes over a reference to channel, which is released when the object is freed
+ObjChannel* newChannel(Collector* collector, Channel* channel) {
+    ObjChannel* object = allocate_obj(collector, ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+// the coroutine starts suspended, about to call closure with the callee and arguments in slots
+ObjCoroutine* newCoroutine(Collector* collector, ObjClosure* closure, Value* slots, int slotCount) {
+    CallFrame* frames = allocate_block(collector, CallFrame, COROUTINE_FRAMES);
+    Value* stack = allocate_block(collector, Value, COROUTINE_STACK);
+    ObjCoroutine* coroutine = allocate_obj(collector, ObjCoroutine, OBJ_COROUTINE);
+    coroutine->closure = closure;
+    Fiber* fiber = &coroutine->fiber;
+    fiber->frames = frames;
+    fiber->fp = 0;
+    fiber->frameCapacity = COROUTINE_FRAMES;
+    fiber->stack = stack;
+    fiber->sp = stack;
+    fiber->stackCapacity = COROUTINE_STACK;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->owner = (Obj*) coroutine;
+    fiber->state = FIBER_SUSPENDED;
+    for (int i = 0; i < slotCount; i++)
+        *fiber->sp++ = slots[i];
+    CallFrame* frame = &fiber->frames[fiber->fp++];
+    frame->closure = closure;
+    frame->pc = closure->function->bytecode->code;
+    frame->localStack = fiber->stack + 1;
+    return coroutine;
+}
+
+// called once a coroutine finishes: nothing can run on its stacks anymore
+void freeFiberStacks(Collector* collector, Fiber* fiber) {
+    free_array(collector, CallFrame, fiber->frames, fiber->frameCapacity);
+    free_array(collector, Value, fiber->stack, fiber->stackCapacity);
+    fiber->frames = NULL;
+    fiber->frameCapacity = 0;
+    fiber->fp = 0;
+    fiber->stack = NULL;
+    fiber->sp = NULL;
+    fiber->stackCapacity = 0;
+}
+
+void closeUpvalue(Collector* collector, ObjUpvalue* upvalue) {
+    // the upvalue may already be unlinked from the open list
+    pushSafeObj(collector, upvalue);
+    upvalue->closed = allocate_pointer(collector, Value, sizeof(Value));
+    popSafe(collector);
     *upvalue->closed = *upvalue->value;
     upvalue->value = upvalue->closed;
+    upvalue->stackOwner = NULL;
+    write_barrier(collector, upvalue, *upvalue->value);
+}
+
+static size_t stringBlockSize(ObjString* string) {
+    return is_rope(string) ? sizeof(ObjRope) : sizeof(ObjString) + string->length + 1;
+}
+
+// bytes of the block holding object, as allocateObj asked for them
+size_t objectBlockSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: return stringBlockSize((ObjString*) object);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_NATIVE_FUNCTION: return sizeof(ObjNativeFunction);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_ARRAY: return sizeof(ObjArray);
+        case OBJ_DICT: return sizeof(ObjDict);
+        case OBJ_ERROR: return sizeof(ObjError);
+        case OBJ_CHANNEL: return sizeof(ObjChannel);
+        case OBJ_COROUTINE: return sizeof(ObjCoroutine);
+    }
+    return 0;
+}
+
+// bytes held by object, with the buffers only it points to
+size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            return stringBlockSize((ObjString*) object);
+        case OBJ_FUNCTION:
+            {
+                Bytecode* bytecode = ((ObjFunction*) object)->bytecode;
+                return sizeof(ObjFunction) + sizeof(Bytecode) + bytecode->capacity
+                    + sizeof(Value) * bytecode->constants.capacity;
+            }
+        case OBJ_NATIVE_FUNCTION:
+            return sizeof(ObjNativeFunction);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*) object)->upvalueCount;
+        case OBJ_UPVALUE:
+            return sizeof(ObjUpvalue) + (((ObjUpvalue*) object)->closed != NULL ? sizeof(Value) : 0);
+        case OBJ_ARRAY:
+            return sizeof(ObjArray) + sizeof(Value) * ((ObjArray*) object)->values.capacity;
+        case OBJ_DICT:
+            {
+                return sizeof(ObjDict) + mapBytes(&((ObjDict*) object)->map);
+            }
+        case OBJ_ERROR:
+            return sizeof(ObjError);
+        case OBJ_CHANNEL:
+            return sizeof(ObjChannel);
+        case OBJ_COROUTINE:
+            {
+                Fiber* fiber = &((ObjCoroutine*) object)->fiber;
+                return sizeof(ObjCoroutine) + sizeof(CallFrame) * fiber->frameCapacity + sizeof(Value) * fiber->stackCapacity;
+            }
+    }
+    return 0;
 }
 
 void freeObject(Collector* collector, Obj* object) {
@@ -167,9 +373,7 @@ void freeObject(Collector* collector, Obj* object) {
     switch (object->type) {                                 
         case OBJ_STRING: 
             {                                    
-                ObjString* string = (ObjString*) object;             
-                free_array(collector, char, string->chars, string->length + 1);
-                free_pointer(collector, object, sizeof(ObjString));                            
+                free_pointer(collector, object, stringBlockSize((ObjString*) object));
                 break;                                              
             }       
         case OBJ_FUNCTION:
@@ -211,19 +415,31 @@ void freeObject(Collector* collector, Obj* object) {
         case OBJ_ARRAY:
             {
                 ObjArray* array = (ObjArray*) object;
-                freeValueArray(collector, array->values);
-                free_pointer(collector, array->values, sizeof(ValueArray));
+                freeValueArray(collector, &array->values);
                 free_pointer(collector, array, sizeof(ObjArray));
                 break;                    
             }
         case OBJ_DICT:
             {
                 ObjDict* dict = (ObjDict*) object;
-                freeMap(collector, dict->map);
-                free_pointer(collector, dict->map, sizeof(HashMap));
+                freeMap(collector, &dict->map);
                 free_pointer(collector, dict, sizeof(ObjDict));
                 break;                    
             }
+        case OBJ_CHANNEL:
+            {
+                ObjChannel* channel = (ObjChannel*) object;
+                releaseChannel(channel->channel);
+                free_pointer(collector, channel, sizeof(ObjChannel));
+                break;
+            }
+        case OBJ_COROUTINE:
+            {
+                ObjCoroutine* coroutine = (ObjCoroutine*) object;
+                freeFiberStacks(collector, &coroutine->fiber);
+                free_pointer(collector, coroutine, sizeof(ObjCoroutine));
+                break;
+            }
     }
 }
 
@@ -234,10 +450,22 @@ void blackenObject(Collector* collector, Obj* obj) {
     printf("\n");                         
 #endif 
     switch (obj->type) {
+        case OBJ_STRING:
+            {
+                // flat strings point nowhere
+                if (!is_rope(obj))
+                    break;
+                ObjRope* rope = (ObjRope*) obj;
+                markObject(collector, (Obj*) rope->left);
+                markObject(collector, (Obj*) rope->right);
+                break;
+            }
         case OBJ_UPVALUE:
             {
                 ObjUpvalue* uv = (ObjUpvalue*) obj;
                 markValue(collector, *uv->value);
+                // an open upvalue points into its coroutine's stack: keep the stack alive
+                markObject(collector, uv->stackOwner);
                 break;
             }
         case OBJ_FUNCTION:
@@ -274,38 +502,80 @@ void blackenObject(Collector* collector, Obj* obj) {
         case OBJ_ARRAY:
             {   
                 ObjArray* array = (ObjArray*) obj;
-                for (int i = 0; i < array->values->count; i++) {
-                    markValue(collector, array->values->values[i]);
+                for (int i = 0; i < array->values.count; i++) {
+                    markValue(collector, array->values.values[i]);
                 }
                 break;
             }
         case OBJ_DICT:
             {   
                 ObjDict* dict = (ObjDict*) obj;
-                markMap(collector, dict->map);
+                markMap(collector, &dict->map);
+                break;
+            }
+        case OBJ_CHANNEL:
+            break;
+        case OBJ_COROUTINE:
+            {
+                ObjCoroutine* coroutine = (ObjCoroutine*) obj;
+                markObject(collector, (Obj*) coroutine->closure);
+                // the running fiber lives in the VM registers and is marked from there
+                if (&coroutine->fiber != collector->vm->fiber)
+                    markFiber(collector, &coroutine->fiber);
                 break;
             }
     }
 }
 
+void markFiber(Collector* collector, Fiber* fiber) {
+    for (Value* value = fiber->stack; value < fiber->sp; value++)
+        markValue(collector, *value);
+    for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        markObject(collector, (Obj*) upvalue);
+}
+
+static void pushWorklist(Collector* collector, Obj* obj) {
+    if (collector->worklistCapacity <= collector->worklistCount + 1) {
+        collector->worklistCapacity = compute_capacity(collector->worklistCapacity);
+        collector->worklist = realloc(collector->worklist, sizeof(Obj*) * (collector->worklistCapacity));
+    }
+    collector->worklist[collector->worklistCount++] = obj;
+}
+
+// turns an object that was already blackened by the running incremental cycle grey again
+void rescanObject(Collector* collector, Obj* obj) {
+    if (collector != NULL && collector->marking && isMarked(obj))
+        pushWorklist(collector, obj);
+}
+
 void markObject(Collector* collector, Obj* obj) {
     if (obj == NULL)
         return;
+    if (collector->snapshot != NULL) {
+        snapshotReference(collector->snapshot, obj);
+        return;
+    }
 #ifdef TRACE_GC
     printf("(pointer %p) mark ", (void*) obj);
     dumpObj(obj);      
     printf("\n");   
 #endif
-    if (obj->marked)
+    // minor collections consider old objects live without tracing them
+    if (isMarked(obj) || (collector->minor && (obj->flags & OBJ_OLD)))
         return;
-    obj->marked = 1;
-    if (obj->type == OBJ_STRING)
-        return; 
-    if (collector->worklistCapacity <= collector->worklistCount + 1) {
-        collector->worklistCapacity = compute_capacity(collector->worklistCapacity);
-        collector->worklist = realloc(collector->worklist, sizeof(Obj*) * (collector->worklistCapacity));
+    if (collector->parallel) {
+        // another mark worker may be claiming the same object, or one next to it
+        int claimed = (obj->flags & OBJ_LARGE) ? !__atomic_exchange_n(&obj->marked, 1, __ATOMIC_RELAXED) : slabMarkAtomic(obj);
+        if (!claimed)
+            return;
+    } else if (obj->flags & OBJ_LARGE) {
+        obj->marked = 1;
+    } else {
+        slabMark(obj);
     }
-    collector->worklist[collector->worklistCount++] = obj;
+    if (obj->type == OBJ_STRING && !is_rope(obj))
+        return; 
+    pushWorklist(collector, obj);
 }
 
 
@@ -330,7 +600,7 @@ int writeValueArray(Collector* collector, ValueArray* valarray, Value value) {
 }
 
 void freeValueArray(Collector* collector, ValueArray* valarray) {
-    free_array(collector, uint8_t, valarray->values, valarray->capacity);
+    free_array(collector, Value, valarray->values, valarray->capacity);
     initValueArray(valarray);
 }
 
@@ -339,10 +609,23 @@ uint32_t hashValue(Value value) {
         case VALUE_NIHL: return hash_nihl;
         case VALUE_BOOL: return hash_bool(value);
         case VALUE_NUMBER: return hash_number(value);
-        case VALUE_OBJ: return as_obj(value)->hash;
+        case VALUE_OBJ: return get_value_hash(value);
     }
 }
 
+// strings hash their characters, the other objects their address, once, the first time a map needs
+// it: compaction moves the hash along with the object. Ropes are flattened before they are hashed
+uint32_t hashObject(Obj* object) {
+    if (object->flags & OBJ_HASHED)
+        return object->hash;
+    if (object->type == OBJ_STRING)
+        object->hash = hash_string(flat_chars((ObjString*) object), ((ObjString*) object)->length);
+    else
+        object->hash = hash_pointer(object);
+    object->flags |= OBJ_HASHED;
+    return object->hash;
+}
+
 void markValue(Collector* collector, Value value) {
     if (!is_obj(value))
         return;
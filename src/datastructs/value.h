@@ -15,29 +15,71 @@ typedef enum {
     OBJ_ARRAY,
     OBJ_DICT,
     OBJ_ERROR,
+    OBJ_CHANNEL,
+    OBJ_COROUTINE,
 } ObjType;
 
+#define OBJ_OLD 1 // survived a collection
+#define OBJ_REMEMBERED 2 // in the remembered set
+#define OBJ_LARGE 4 // too big for a slab block, it carries its own mark
+#define OBJ_HASHED 8 // hash is set, computed on first use
+#define OBJ_INTERNED 16 // a string of the interned set, the only one with its characters
+#define OBJ_ROPE 32 // a string made of two others, an ObjRope
+#define OBJ_MOVED 64 // left behind by a copy, whose address follows the header
+
+// the collector finds objects through the slab bitmaps and its own arrays, not through the header
 struct sObj {
-    ObjType type;
+    uint8_t type; // an ObjType
+    uint8_t flags;
+    uint8_t marked; // set atomically while marking in parallel
     uint32_t hash;
-    int marked;
-    struct sObj* next;
 };
 
 typedef struct sObj Obj;
 
+struct sValueArray {
+    int count;
+    int capacity;
+    Value* values;
+};
+
+// defined here so that dicts embed it, the entries are in hash_map.h
+struct sHashMap {
+    struct sEntry* entries; // in insertion order
+    uint32_t* index; // the entry of each slot, followed in the same block by the control bytes
+    uint8_t* control; // whether each slot is empty, deleted or full, with 7 bits of the hash of its key
+    int capacity; // slots of the index: 0 while the map has none, then a power of two, at least a group
+    int entryCapacity;
+    int count;
+};
+
 typedef struct {
     Obj obj;
     int length;
-    char* chars;
+    char chars[]; // null terminated
 } ObjString;
 
+// the result of a concatenation, which copies nothing until its characters are read: the
+// first read flattens it into a string of its own, and it then forwards to that string
+typedef struct {
+    Obj obj;
+    int length; // where an ObjString has it, so that lengths are read the same way
+    ObjString* left; // the flat string once flattened
+    ObjString* right; // NULL once flattened
+} ObjRope;
+
+#define is_rope(string) (((Obj*) (string))->flags & OBJ_ROPE)
+#define is_flat(string) (!is_rope(string) || ((ObjRope*) (string))->right == NULL)
+// the characters of a flat string, or of a rope flattened already
+#define flat_chars(string) (is_rope(string) ? ((ObjRope*) (string))->left->chars : (string)->chars)
+
 typedef struct {
     Obj obj;
     int arity;
     ObjString* name;
     Bytecode* bytecode;
     int upvalueCount;
+    int isGenerator; // contains yield: calling it creates a coroutine
 } ObjFunction;
 
 typedef Value (*CNativeFunction)(VM* vm, Value* args);
@@ -55,6 +97,7 @@ struct sObjUpvalue {
     Obj obj;
     Value* value;
     Value* closed;
+    Obj* stackOwner; // coroutine whose stack holds the open value, NULL for the main stack
     struct sObjUpvalue* next;
 };
 
@@ -75,17 +118,68 @@ typedef struct {
 
 typedef struct {
     Obj obj;
-    ValueArray* values;
+    ValueArray values;
 } ObjArray;
 
 typedef struct {
     Obj obj;
-    HashMap* map;
+    HashMap map;
 } ObjDict;
 
+typedef struct {
+    Obj obj;
+    Channel* channel;
+} ObjChannel;
+
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* pc;
+    Value* localStack;
+} CallFrame;
+
+typedef enum {
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,
+    FIBER_DONE,
+} FiberState;
+
+// a call stack segment: the VM switches between fibers by swapping pointers, never copying frames
+struct sFiber {
+    CallFrame* frames;
+    int fp;
+    int frameCapacity;
+    Value* stack;
+    Value* sp;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    struct sFiber* caller; // fiber that resumed this one while it runs
+    Obj* owner; // NULL for the main fiber
+    FiberState state;
+};
+
+typedef struct sFiber Fiber;
+
+typedef struct {
+    Obj obj;
+    ObjClosure* closure;
+    Fiber fiber;
+} ObjCoroutine;
+
+// a string that is neither hashed nor interned until a map needs it
 ObjString* copyString(Collector* collector, char* chars, int length);
 ObjString* copyNoLengthString(Collector* collector, char* chars);
-ObjString* takeString(Collector* collector, char* chars, int length);
+// a string whose characters are left to fill, before anything else is allocated
+ObjString* newString(Collector* collector, int length);
+ObjString* copyInternedString(Collector* collector, char* chars, int length);
+// fills the table of one-character strings that indexing a string reads its characters from
+void internCharacters(Collector* collector);
+// the interned string with the characters of string, which becomes it if there is none yet
+ObjString* internString(Collector* collector, ObjString* string);
+// left followed by right, with both of them on the stack
+ObjString* newRope(Collector* collector, ObjString* left, ObjString* right);
+// a string holding the characters of string in its chars: string itself unless it is a rope
+ObjString* flattenString(Collector* collector, ObjString* string);
+void copyStringChars(ObjString* string, char* out);
 ObjFunction* newFunction(Collector* collector);
 ObjNativeFunction* newNativeFunction(Collector* collector, int arity, char* nameChars, CNativeFunction cfunction);
 ObjClosure* newClosure(Collector* collector, ObjFunction* function);
@@ -95,9 +189,16 @@ ObjDict* newDict(Collector* collector);
 ObjError* newError(Collector* collector, ObjString* message);
 ObjError* newErrorSafe(Collector* collector, ObjString* message);
 ObjError* newErrorFromCharArray(Collector* collector, char* message);
-void closeUpvalue(ObjUpvalue* upvalue);
+ObjChannel* newChannel(Collector* collector, Channel* channel);
+ObjCoroutine* newCoroutine(Collector* collector, ObjClosure* closure, Value* slots, int slotCount);
+void freeFiberStacks(Collector* collector, Fiber* fiber);
+void markFiber(Collector* collector, Fiber* fiber);
+void closeUpvalue(Collector* collector, ObjUpvalue* upvalue);
 void freeObject(Collector* collector, Obj* object);
+size_t objectSize(Obj* object);
+size_t objectBlockSize(Obj* object);
 void markObject(Collector* collector, Obj* obj);
+void rescanObject(Collector* collector, Obj* obj);
 void blackenObject(Collector* collector, Obj* obj);
 
 typedef enum {
@@ -138,6 +239,8 @@ struct sValue {
 #define is_array(value) isObjType(value, OBJ_ARRAY)
 #define is_dict(value) isObjType(value, OBJ_DICT)
 #define is_error(value) isObjType(value, OBJ_ERROR)
+#define is_channel(value) isObjType(value, OBJ_CHANNEL)
+#define is_coroutine(value) isObjType(value, OBJ_COROUTINE)
 
 #define as_function(value) ((ObjFunction*) as_obj(value))
 #define as_native(value) ((ObjNativeFunction*) as_obj(value))
@@ -148,24 +251,25 @@ struct sValue {
 #define as_string(value) ((ObjString*) as_obj(value))
 #define as_array(value) ((ObjArray*) as_obj(value))
 #define as_dict(value) ((ObjDict*) as_obj(value))
-#define as_cstring(value) (as_string(value)->chars)
+#define as_channel(value) ((ObjChannel*) as_obj(value))
+#define as_coroutine(value) ((ObjCoroutine*) as_obj(value))
+#define as_cstring(collector, value) (flattenString(collector, as_string(value))->chars)
 
 int isObjType(Value value, ObjType type);
 
-struct sValueArray {
-    int count;
-    int capacity;
-    Value* values;
-};
-
 #define hash_bool(b) hash_int(as_cbool(b) + 31)
 #define hash_nihl hash_int(42)
 #define hash_number(n) hash_double(as_cnumber(n))
 
 uint32_t hashValue(Value val);
 
+uint32_t hashObject(Obj* object);
+
 static inline uint32_t get_value_hash(Value val) {
-    return is_obj(val) ? as_obj(val)->hash : hashValue(val);
+    if (!is_obj(val))
+        return hashValue(val);
+    Obj* object = as_obj(val);
+    return (object->flags & OBJ_HASHED) ? object->hash : hashObject(object);
 }
 
 void initValueArray(ValueArray* valarray);
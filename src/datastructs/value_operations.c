@@ -1,25 +1,31 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../util.h"
 #include "value_operations.h"
 #include "value.h"
 #include "../memory.h"
+#include "channel.h"
 
 // GC INVARIANT: PARAMETERS PASSED ARE ALREADY ON THE STACK (exceptions are *Safe functions)
 
+// concatenations at least this long make ropes: shorter ones copy fewer bytes than a rope takes
+#define ROPE_MIN_LENGTH 128
+
 int indexGetArray(Collector* collector, ObjArray* array, Value* index, Value* result) {
     if (!valueInteger(*index)) {
         *result = to_vobj(newErrorFromCharArray(collector, "invalid index for array"));
         return 0;
     }
     int cindex = (int) as_cnumber(*index);
-    int count = array->values->count;
+    int count = array->values.count;
     if (cindex < 0 || cindex >= count) {
         *result = to_vobj(newErrorFromCharArray(collector, "array index out of bounds"));
         return 0;
     }
-    *result = array->values->values[cindex];
+    *result = array->values.values[cindex];
     return 1;
 }
 
@@ -29,12 +35,13 @@ int indexSetArray(Collector* collector, ObjArray* array, Value* index, Value* va
         return 0;
     }
     int cindex = (int) as_cnumber(*index);
-    int count = array->values->count;
+    int count = array->values.count;
     if (cindex < 0 || cindex >= count) {
         *result = to_vobj(newErrorFromCharArray(collector, "array index out of bounds"));
         return 0;
     }
-    array->values->values[cindex] = *value;
+    array->values.values[cindex] = *value;
+    slot_barrier(collector, array, cindex, *value);
     return 1;
 }
 
@@ -48,7 +55,8 @@ int indexGetString(Collector* collector, ObjString* string, Value* index, Value*
         *result = to_vobj(newErrorFromCharArray(collector, "string index out of bounds"));
         return 0;
     }
-    *result = to_vobj(copyString(collector, string->chars + cindex, 1));
+    ObjString* flat = flattenString(collector, string);
+    *result = to_vobj(collector->characters[(uint8_t) flat->chars[cindex]]);
     return 1;
 }
 
@@ -61,7 +69,7 @@ void indexGetObject(Collector* collector, Obj* array, Value* index, Value* resul
                 indexGetArray(collector, (ObjArray*) array, index, result);
                 break;
         case OBJ_DICT:
-                indexGetDict((ObjDict*) array, index, result);
+                indexGetDict(collector, (ObjDict*) array, index, result);
                 break;
         default:
                 *result = to_vobj(newErrorFromCharArray(collector, "object not indexable"));
@@ -85,28 +93,37 @@ void indexSetObject(Collector* collector, Obj* array, Value* index, Value* value
 }
 
 static ObjArray* concatenateArrays(Collector* collector, ObjArray* a, ObjArray* b) {
+    if (!fitsHeapLimit(collector, sizeof(Value) * ((size_t) a->values.count + b->values.count)))
+        return NULL;
     ObjArray* newArr = newArray(collector);
     pushSafeObj(collector, newArr);
-    for (int i = 0; i < a->values->count; i++) {
-        arrayPush(collector, newArr, a->values->values[i]);
+    for (int i = 0; i < a->values.count; i++) {
+        arrayPush(collector, newArr, a->values.values[i]);
     }
-    for (int i = 0; i < b->values->count; i++) {
-        arrayPush(collector, newArr, b->values->values[i]);
+    for (int i = 0; i < b->values.count; i++) {
+        arrayPush(collector, newArr, b->values.values[i]);
     }
     popSafe(collector);
     return newArr;
 }
 
+// lengths are ints: past INT_MAX they would wrap around
+static int tooLongToConcatenate(ObjString* sa, ObjString* sb) {
+    return (long long) sa->length + sb->length > INT_MAX;
+}
+
+// a loop appending to a string builds a rope in linear time, where copies would take quadratic time
 ObjString* concatenateStrings(Collector* collector, ObjString* sa, ObjString* sb) {
-    int length = sa->length + sb->length;
-    if (length == 0)
-        return copyString(collector, "", 0);
-    
-    char* chars = allocate_block(collector, char, length + 1);
-    memcpy(chars, sa->chars, sa->length);
-    memcpy(chars + sa->length, sb->chars, sb->length);
-    chars[length] = '\0'; 
-    ObjString* result = takeString(collector, chars, length);
+    // ++ raises an error value first: the strings built by tostr have no way to report one
+    if (tooLongToConcatenate(sa, sb)) {
+        fprintf(stderr, "string too long\n");
+        exit(1);
+    }
+    if (sa->length + sb->length >= ROPE_MIN_LENGTH)
+        return newRope(collector, sa, sb);
+    ObjString* result = newString(collector, sa->length + sb->length);
+    copyStringChars(sa, result->chars);
+    copyStringChars(sb, result->chars + sa->length);
     return result;
 }
 
@@ -229,16 +246,16 @@ ObjString* objectToString(Collector* collector, Obj* obj) {
             {
                 ObjArray* array = (ObjArray*) obj;
                 ObjString* result = copyNoLengthString(collector, "[");
-                for (int i = 0; i < array->values->count - 1; i++) {
-                    Value val = array->values->values[i];
+                for (int i = 0; i < array->values.count - 1; i++) {
+                    Value val = array->values.values[i];
                     pushSafeObj(collector, result);
                     result = concatenateStringsSafe(collector, result, strOrSelf(collector, obj, val));
                     popSafe(collector);
                     result = concatenateStringAndCharArraySafe(collector, result, ",");
                 }
-                if (array->values->count > 0) {
-                    int index = array->values->count - 1;
-                    Value val = array->values->values[index];
+                if (array->values.count > 0) {
+                    int index = array->values.count - 1;
+                    Value val = array->values.values[index];
                     pushSafeObj(collector, result);
                     result = concatenateStringsSafe(collector, result, strOrSelf(collector, obj, val));
                     popSafe(collector);
@@ -250,26 +267,33 @@ ObjString* objectToString(Collector* collector, Obj* obj) {
             {
                 ObjDict* dict = (ObjDict*) obj;
                 ObjString* result = copyNoLengthString(collector, "{");
-                HashMap* map = dict->map;
-                for (int i = 0; i < map->capacity; i++) {
-                    Entry* entry = map->entries[i];
-                    while (entry != NULL) {
-                        pushSafeObj(collector, result);
-                        result = concatenateStringsSafe(collector, result, 
-                                strOrSelf(collector, obj, entry->key));
-                        popSafe(collector);
-                        result = concatenateStringAndCharArraySafe(collector, result, " => ");
-                        pushSafeObj(collector, result);
-                        result = concatenateStringsSafe(collector, result, 
-                                strOrSelf(collector, obj, entry->value));
-                        popSafe(collector);
-                        result = concatenateStringAndCharArraySafe(collector, result, ",");
-                        entry = entry->next;
-                    }
+                HashMap* map = &dict->map;
+                for (int i = 0; i < map->count; i++) {
+                    Entry* entry = &map->entries[i];
+                    pushSafeObj(collector, result);
+                    result = concatenateStringsSafe(collector, result, 
+                            strOrSelf(collector, obj, entry->key));
+                    popSafe(collector);
+                    result = concatenateStringAndCharArraySafe(collector, result, " => ");
+                    pushSafeObj(collector, result);
+                    result = concatenateStringsSafe(collector, result, 
+                            strOrSelf(collector, obj, entry->value));
+                    popSafe(collector);
+                    result = concatenateStringAndCharArraySafe(collector, result, ",");
                 }
                 result = concatenateStringAndCharArraySafe(collector, result, "}");
                 return result;
             }
+        case OBJ_CHANNEL:
+            {
+                ObjChannel* channel = (ObjChannel*) obj;
+                return concatenateMultipleCharArrays(collector, "<", channel->channel->name, " channel>", NULL);
+            }
+        case OBJ_COROUTINE:
+            {
+                ObjCoroutine* coroutine = (ObjCoroutine*) obj;
+                return concatenateMultipleCharArrays(collector, "<", coroutine->closure->function->name->chars, " coroutine>", NULL);
+            }
     }
 }
 
@@ -279,9 +303,19 @@ Obj* concatenateObjects(Collector* collector, Obj* a, Obj* b) {
     }
     switch (a->type) {
         case OBJ_STRING:
+            if (tooLongToConcatenate((ObjString*) a, (ObjString*) b))
+                return (Obj*) newErrorFromCharArray(collector, "string too long");
+            // a rope costs little, but its characters are copied out once it is read
+            if (!fitsHeapLimit(collector, (size_t) ((ObjString*) a)->length + ((ObjString*) b)->length + 1))
+                return (Obj*) newErrorFromCharArray(collector, "heap limit exceeded");
             return (Obj*) concatenateStrings(collector, (ObjString*) a, (ObjString*) b);
         case OBJ_ARRAY:
-            return (Obj*) concatenateArrays(collector, (ObjArray*) a, (ObjArray*) b);
+            {
+                ObjArray* result = concatenateArrays(collector, (ObjArray*) a, (ObjArray*) b);
+                if (result == NULL)
+                    return (Obj*) newErrorFromCharArray(collector, "heap limit exceeded");
+                return (Obj*) result;
+            }
         default:
             return (Obj*) newErrorFromCharArray(collector, 
                     "cannot concatenate objects that are not strings or arrays");
@@ -294,12 +328,12 @@ ObjArray* pairList(Collector* collector, Obj* arrayLike) {
     switch (arrayLike->type) {
         case OBJ_STRING:
             {
-                ObjString* str = (ObjString*) arrayLike;
+                ObjString* str = flattenString(collector, (ObjString*) arrayLike);
                 for (int i = 0; i < str->length; i++) {
                     ObjArray* pair = newArray(collector);
                     pushSafeObj(collector, pair);
                     arrayPush(collector, pair, to_vnumber(i));
-                    arrayPush(collector, pair, to_vobj(copyString(collector, str->chars + i, 1)));
+                    arrayPush(collector, pair, to_vobj(collector->characters[(uint8_t) str->chars[i]]));
                     arrayPush(collector, result, to_vobj(pair));
                     popSafe(collector);
                 }
@@ -308,11 +342,11 @@ ObjArray* pairList(Collector* collector, Obj* arrayLike) {
         case OBJ_ARRAY:
             {
                 ObjArray* arr = (ObjArray*) arrayLike;
-                for (int i = 0; i < arr->values->count; i++) {
+                for (int i = 0; i < arr->values.count; i++) {
                     ObjArray* pair = newArray(collector);
                     pushSafeObj(collector, pair);
                     arrayPush(collector, pair, to_vnumber(i));
-                    arrayPush(collector, pair, arr->values->values[i]);
+                    arrayPush(collector, pair, arr->values.values[i]);
                     arrayPush(collector, result, to_vobj(pair));
                     popSafe(collector);
                 }
@@ -321,18 +355,14 @@ ObjArray* pairList(Collector* collector, Obj* arrayLike) {
         case OBJ_DICT:
             {
                 ObjDict* dict = (ObjDict*) arrayLike;
-                HashMap* map = dict->map;
-                for (int i = 0; i < map->capacity; i++) {
-                    Entry* entry = map->entries[i];
-                    while (entry != NULL) {
-                        ObjArray* pair = newArray(collector);
-                        pushSafeObj(collector, pair);
-                        arrayPush(collector, pair, entry->key);
-                        arrayPush(collector, pair, entry->value);
-                        arrayPush(collector, result, to_vobj(pair));
-                        popSafe(collector);
-                        entry = entry->next;
-                    }
+                HashMap* map = &dict->map;
+                for (int i = 0; i < map->count; i++) {
+                    ObjArray* pair = newArray(collector);
+                    pushSafeObj(collector, pair);
+                    arrayPush(collector, pair, map->entries[i].key);
+                    arrayPush(collector, pair, map->entries[i].value);
+                    arrayPush(collector, result, to_vobj(pair));
+                    popSafe(collector);
                 }
                 break;
             }
@@ -342,16 +372,29 @@ ObjArray* pairList(Collector* collector, Obj* arrayLike) {
 }
 
 void arrayPush(Collector* collector, ObjArray* array, Value value) {
-    writeValueArray(collector, array->values, value);
+    writeValueArray(collector, &array->values, value);
+    slot_barrier(collector, array, array->values.count - 1, value);
 }
 
 int indexSetDict(Collector* collector, ObjDict* dict, Value* key, Value* value) {
-    int res = mapPut(collector, dict->map, *key, *value);
+    // keys are interned, so that keys built the same way compare by address. The interned
+    // string may be referenced by nothing else while the map grows
+    if (is_string(*key))
+        *key = to_vobj(internString(collector, as_string(*key)));
+    pushSafe(collector, *key);
+    int entry;
+    int res = mapPutAt(collector, &dict->map, *key, *value, &entry);
+    popSafe(collector);
+    slot_barrier(collector, dict, entry, *key);
+    slot_barrier(collector, dict, entry, *value);
     return res;
 }
 
-int indexGetDict(ObjDict* dict, Value* key, Value* result) {
-    return mapGet(dict->map, *key, result);
+int indexGetDict(Collector* collector, ObjDict* dict, Value* key, Value* result) {
+    // a rope key would be copied on every probe that compares it
+    if (is_string(*key))
+        *key = to_vobj(flattenString(collector, as_string(*key)));
+    return mapGet(&dict->map, *key, result);
 }
 
 int valueIndexable(Value val) {
@@ -398,7 +441,10 @@ ObjString* valueToString(Collector* collector, Value value) {
 }
 
 void printValue(Collector* collector, Value val) {
-    printf("%s", valueToString(collector, val)->chars); 
+    ObjString* string = valueToString(collector, val);
+    pushSafeObj(collector, string);
+    printf("%s", flattenString(collector, string)->chars);
+    popSafe(collector);
 }
 
 int isTruthy(Value val) {
@@ -416,15 +462,15 @@ int valuesIntegers(Value a, Value b) {
     return valueInteger(a) && valueInteger(b);
 }
 
-int valuesEqual(Value a, Value b) {
-    if (a.type != b.type)
+// two distinct strings, of which at most one is interned. Both are flat, or ropes flattened already
+int stringsEqual(ObjString* a, ObjString* b) {
+    Obj* left = (Obj*) a;
+    Obj* right = (Obj*) b;
+    if ((left->flags & right->flags & OBJ_INTERNED) || a->length != b->length)
         return 0;
-    switch (a.type) {
-        case VALUE_NIHL: return 1;
-        case VALUE_NUMBER: return as_cnumber(a) == as_cnumber(b);
-        case VALUE_BOOL: return as_cbool(a) == as_cbool(b);
-        case VALUE_OBJ: return as_obj(a) == as_obj(b);
-    }
+    if ((left->flags & right->flags & OBJ_HASHED) && left->hash != right->hash)
+        return 0;
+    return memcmp(flat_chars(a), flat_chars(b), a->length) == 0;
 }
 
 int valuesConcatenable(Value a, Value b) {
@@ -436,7 +482,7 @@ int valuesNumbers(Value a, Value b) {
 }
 
 int isCallable(Value value) {
-    return is_closure(value) || is_native(value);
+    return is_closure(value) || is_native(value) || is_coroutine(value);
 }
 
 Value concatenate(Collector* collector, Value a, Value b) {
@@ -451,7 +497,7 @@ int arrayLikeLength(Obj* obj) {
         case OBJ_STRING:
             return ((ObjString*) obj)->length;
         case OBJ_ARRAY:
-            return ((ObjArray*) obj)->values->count;
+            return ((ObjArray*) obj)->values.count;
     }
     return -1;
 }
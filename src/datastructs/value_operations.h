@@ -18,7 +18,7 @@ ObjArray* pairList(Collector* collector, Obj* arrayLike);
 Obj* concatenateObjects(Collector* collector, Obj* a, Obj* b);
 void arrayPush(Collector* collector, ObjArray* array, Value value);
 int indexSetDict(Collector* collector, ObjDict* dict, Value* key, Value* value);
-int indexGetDict(ObjDict* dict, Value* key, Value* result);
+int indexGetDict(Collector* collector, ObjDict* dict, Value* key, Value* result);
 int indexSetArray(Collector* collector, ObjArray* array, Value* index, Value* value, Value* result);
 int indexGetArray(Collector* collector, ObjArray* array, Value* index, Value* result);
 int indexGetString(Collector* collector, ObjString* string, Value* index, Value* result);
@@ -31,12 +31,29 @@ void printValue(Collector* collector, Value val);
 int isTruthy(Value val); 
 int valueInteger(Value value);
 int valuesIntegers(Value a, Value b); 
-int valuesEqual(Value a, Value b); 
 int valuesConcatenable(Value a, Value b); 
 int arrayLikeLength(Obj* obj);
 int valuesNumbers(Value a, Value b); 
 int valueIndexable(Value val);
 int isCallable(Value value);
-Value concatenate(Collector* collector, Value a, Value b); 
+Value concatenate(Collector* collector, Value a, Value b);
+
+int stringsEqual(ObjString* a, ObjString* b);
+
+// inline, as maps compare keys with it in their probe loops
+static inline int valuesEqual(Value a, Value b) {
+    if (a.type != b.type)
+        return 0;
+    switch (a.type) {
+        case VALUE_NIHL: return 1;
+        case VALUE_NUMBER: return as_cnumber(a) == as_cnumber(b);
+        case VALUE_BOOL: return as_cbool(a) == as_cbool(b);
+        case VALUE_OBJ:
+            // strings built at run time are not interned: another string may have their characters
+            return as_obj(a) == as_obj(b) || (as_obj(a)->type == OBJ_STRING && as_obj(b)->type == OBJ_STRING
+                    && stringsEqual(as_string(a), as_string(b)));
+    }
+    return 0;
+} 
 
 #endif
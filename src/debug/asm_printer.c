@@ -101,6 +101,7 @@ int printInstruction(Bytecode* bytecode, OpCode code, int offset) {
             print_argumented_instruction(OP_DICT)
             print_argumented_long_instruction(OP_DICT_LONG)
             print_simple_instruction(OP_RET)
+            print_simple_instruction(OP_YIELD)
             print_simple_instruction(OP_CLOSE_UPVALUE)
             print_simple_instruction(OP_INDEXING_GET)
             print_simple_instruction(OP_INDEXING_SET)
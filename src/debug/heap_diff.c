@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap_diff.h"
+
+#define NAME_LENGTH 128
+// sites listed by the diff, the others are left out
+#define SHOWN_SITES 10
+// objects shown at each end of a long retaining path
+#define PATH_ENDS 4
+
+typedef struct {
+    char name[NAME_LENGTH];
+    int line; // -1 for kinds
+    size_t count;
+    size_t bytes;
+    size_t retained;
+} Group;
+
+typedef struct {
+    Group* groups;
+    int count;
+    int capacity;
+} Groups;
+
+typedef struct {
+    size_t objects;
+    size_t bytes;
+    Groups kinds;
+    Groups sites;
+    int* siteIds; // the position in sites of each site id of the file, -1 for none
+    int siteIdCapacity;
+    // the graph, read from the later snapshot only
+    int* objectKind;
+    int* objectSite;
+    int objectCount;
+    int objectCapacity;
+    int* from; // -1 for the roots
+    int* to;
+    size_t edgeCount;
+    size_t edgeCapacity;
+} Snapshot;
+
+typedef struct {
+    const Group* group;
+    long long count;
+    long long bytes;
+    long long retained;
+} Delta;
+
+static int addGroup(Groups* groups, const char* name, int line, size_t count, size_t bytes, size_t retained) {
+    if (groups->count == groups->capacity) {
+        groups->capacity = groups->capacity < 8 ? 8 : groups->capacity * 2;
+        groups->groups = (Group*) realloc(groups->groups, sizeof(Group) * groups->capacity);
+    }
+    Group* group = &groups->groups[groups->count];
+    snprintf(group->name, sizeof(group->name), "%s", name);
+    group->line = line;
+    group->count = count;
+    group->bytes = bytes;
+    group->retained = retained;
+    return groups->count++;
+}
+
+static int findGroup(Groups* groups, const char* name, int line) {
+    for (int i = 0; i < groups->count; i++) {
+        if (groups->groups[i].line == line && strcmp(groups->groups[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void addObject(Snapshot* snapshot, int kind, int site) {
+    if (snapshot->objectCount == snapshot->objectCapacity) {
+        snapshot->objectCapacity = snapshot->objectCapacity < 64 ? 64 : snapshot->objectCapacity * 2;
+        snapshot->objectKind = (int*) realloc(snapshot->objectKind, sizeof(int) * snapshot->objectCapacity);
+        snapshot->objectSite = (int*) realloc(snapshot->objectSite, sizeof(int) * snapshot->objectCapacity);
+    }
+    snapshot->objectKind[snapshot->objectCount] = kind;
+    snapshot->objectSite[snapshot->objectCount++] = site;
+}
+
+static void addEdge(Snapshot* snapshot, int from, int to) {
+    if (snapshot->edgeCount == snapshot->edgeCapacity) {
+        snapshot->edgeCapacity = snapshot->edgeCapacity < 64 ? 64 : snapshot->edgeCapacity * 2;
+        snapshot->from = (int*) realloc(snapshot->from, sizeof(int) * snapshot->edgeCapacity);
+        snapshot->to = (int*) realloc(snapshot->to, sizeof(int) * snapshot->edgeCapacity);
+    }
+    snapshot->from[snapshot->edgeCount] = from;
+    snapshot->to[snapshot->edgeCount++] = to;
+}
+
+static void freeSnapshot(Snapshot* snapshot) {
+    free(snapshot->kinds.groups);
+    free(snapshot->sites.groups);
+    free(snapshot->siteIds);
+    free(snapshot->objectKind);
+    free(snapshot->objectSite);
+    free(snapshot->from);
+    free(snapshot->to);
+}
+
+static int readSnapshot(const char* path, Snapshot* snapshot, int withGraph) {
+    memset(snapshot, 0, sizeof(Snapshot));
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "cannot open heap snapshot at path \"%s\"\n", path);
+        return 0;
+    }
+    char line[512];
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, "lanthanum heap snapshot\n") != 0) {
+        fprintf(stderr, "\"%s\" is not a heap snapshot\n", path);
+        fclose(file);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[NAME_LENGTH], kind[NAME_LENGTH];
+        size_t count, bytes, retained;
+        int id, site, from, to, siteLine;
+        if (sscanf(line, "total %zu %zu", &snapshot->objects, &snapshot->bytes) == 2) {
+            continue;
+        } else if (sscanf(line, "kind %127s %zu %zu %zu", name, &count, &bytes, &retained) == 4) {
+            addGroup(&snapshot->kinds, name, -1, count, bytes, retained);
+        } else if (sscanf(line, "site %d %127s %d %zu %zu %zu", &id, name, &siteLine, &count, &bytes, &retained) == 6) {
+            if (id < 0)
+                continue;
+            if (id >= snapshot->siteIdCapacity) {
+                int capacity = snapshot->siteIdCapacity;
+                snapshot->siteIdCapacity = id < 64 ? 128 : id * 2;
+                snapshot->siteIds = (int*) realloc(snapshot->siteIds, sizeof(int) * snapshot->siteIdCapacity);
+                for (int i = capacity; i < snapshot->siteIdCapacity; i++)
+                    snapshot->siteIds[i] = -1;
+            }
+            snapshot->siteIds[id] = addGroup(&snapshot->sites, name, siteLine, count, bytes, retained);
+        } else if (!withGraph) {
+            continue;
+        } else if (sscanf(line, "object %d %127s %zu %d", &id, kind, &bytes, &site) == 4) {
+            int position = site >= 0 && site < snapshot->siteIdCapacity ? snapshot->siteIds[site] : -1;
+            addObject(snapshot, findGroup(&snapshot->kinds, kind, -1), position);
+        } else if (sscanf(line, "ref %d %d", &from, &to) == 2) {
+            addEdge(snapshot, from, to);
+        } else if (sscanf(line, "root %d", &to) == 1) {
+            addEdge(snapshot, -1, to);
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+static void formatBytes(long long bytes, char* buffer, size_t size) {
+    long long magnitude = bytes < 0 ? -bytes : bytes;
+    if (magnitude >= 1024 * 1024)
+        snprintf(buffer, size, "%+.1f MB", bytes / (1024.0 * 1024.0));
+    else if (magnitude >= 1024)
+        snprintf(buffer, size, "%+.1f KB", bytes / 1024.0);
+    else
+        snprintf(buffer, size, "%+lld B", bytes);
+}
+
+static int byGrowth(const void* a, const void* b) {
+    const Delta* da = (const Delta*) a;
+    const Delta* db = (const Delta*) b;
+    if (da->bytes != db->bytes)
+        return da->bytes < db->bytes ? 1 : -1;
+    return da->count < db->count ? 1 : (da->count > db->count ? -1 : 0);
+}
+
+// the groups of after matched by name against those of before, the vanished ones included
+static Delta* diffGroups(Groups* before, Groups* after, int* count) {
+    Delta* deltas = (Delta*) malloc(sizeof(Delta) * (before->count + after->count + 1));
+    *count = 0;
+    for (int i = 0; i < after->count; i++) {
+        Group* group = &after->groups[i];
+        int old = findGroup(before, group->name, group->line);
+        Group* previous = old >= 0 ? &before->groups[old] : NULL;
+        deltas[(*count)++] = (Delta) {
+            .group = group,
+            .count = (long long) group->count - (previous != NULL ? (long long) previous->count : 0),
+            .bytes = (long long) group->bytes - (previous != NULL ? (long long) previous->bytes : 0),
+            .retained = (long long) group->retained - (previous != NULL ? (long long) previous->retained : 0),
+        };
+    }
+    for (int i = 0; i < before->count; i++) {
+        Group* group = &before->groups[i];
+        if (findGroup(after, group->name, group->line) < 0)
+            deltas[(*count)++] = (Delta) {group, -(long long) group->count, -(long long) group->bytes, -(long long) group->retained};
+    }
+    qsort(deltas, *count, sizeof(Delta), byGrowth);
+    return deltas;
+}
+
+static void printGroupName(const Group* group) {
+    if (group->line < 0)
+        printf("%s", group->name);
+    else
+        printf("%s:%d", group->name, group->line);
+}
+
+static void printDeltas(const char* title, Delta* deltas, int count, int shown) {
+    printf("%s:\n", title);
+    for (int i = 0; i < count && shown > 0; i++) {
+        if (deltas[i].count == 0 && deltas[i].bytes == 0 && deltas[i].retained == 0)
+            continue;
+        char bytes[32], retained[32];
+        formatBytes(deltas[i].bytes, bytes, sizeof(bytes));
+        formatBytes(deltas[i].retained, retained, sizeof(retained));
+        printf("  %+10lld objects %12s %12s retained  ", deltas[i].count, bytes, retained);
+        printGroupName(deltas[i].group);
+        printf("\n");
+        shown--;
+    }
+}
+
+static void printObject(Snapshot* snapshot, int object) {
+    int kind = snapshot->objectKind[object];
+    int site = snapshot->objectSite[object];
+    printf("%s", kind >= 0 ? snapshot->kinds.groups[kind].name : "?");
+    if (site >= 0 && strcmp(snapshot->sites.groups[site].name, "?") != 0) {
+        printf(" from ");
+        printGroupName(&snapshot->sites.groups[site]);
+    }
+}
+
+// the shortest chain of references from the roots to an object allocated at site
+static void printRetainers(Snapshot* snapshot, int site) {
+    int objects = snapshot->objectCount;
+    size_t* start = (size_t*) calloc(objects + 1, sizeof(size_t));
+    int* next = (int*) malloc(sizeof(int) * (snapshot->edgeCount + 1));
+    int* parent = (int*) malloc(sizeof(int) * (objects + 1));
+    int* queue = (int*) malloc(sizeof(int) * (objects + 1));
+    for (size_t i = 0; i < snapshot->edgeCount; i++) {
+        if (snapshot->from[i] >= 0 && snapshot->from[i] < objects)
+            start[snapshot->from[i] + 1]++;
+    }
+    for (int i = 0; i < objects; i++)
+        start[i + 1] += start[i];
+    size_t* fill = (size_t*) malloc(sizeof(size_t) * (objects + 1));
+    memcpy(fill, start, sizeof(size_t) * (objects + 1));
+    for (size_t i = 0; i < snapshot->edgeCount; i++) {
+        if (snapshot->from[i] >= 0 && snapshot->from[i] < objects)
+            next[fill[snapshot->from[i]]++] = snapshot->to[i];
+    }
+    free(fill);
+
+    int head = 0, tail = 0, found = -1;
+    for (int i = 0; i < objects; i++)
+        parent[i] = -2; // not reached yet
+    for (size_t i = 0; i < snapshot->edgeCount; i++) {
+        int root = snapshot->to[i];
+        if (snapshot->from[i] < 0 && root >= 0 && root < objects && parent[root] == -2) {
+            parent[root] = -1;
+            queue[tail++] = root;
+        }
+    }
+    while (head < tail && found < 0) {
+        int object = queue[head++];
+        if (snapshot->objectSite[object] == site) {
+            found = object;
+            break;
+        }
+        for (size_t e = start[object]; e < start[object + 1]; e++) {
+            int reached = next[e];
+            if (reached >= 0 && reached < objects && parent[reached] == -2) {
+                parent[reached] = object;
+                queue[tail++] = reached;
+            }
+        }
+    }
+    if (found >= 0) {
+        int length = 0;
+        for (int object = found; object >= 0; object = parent[object])
+            queue[length++] = object;
+        printf("\n");
+        printGroupName(&snapshot->sites.groups[site]);
+        printf(" grew the most, its objects are reached through:\n  roots");
+        for (int i = length - 1; i >= 0; i--) {
+            if (length > 2 * PATH_ENDS && i == length - 1 - PATH_ENDS) {
+                printf("\n  -> ... %d more", length - 2 * PATH_ENDS);
+                i = PATH_ENDS - 1;
+            }
+            printf("\n  -> ");
+            printObject(snapshot, queue[i]);
+        }
+        printf("\n");
+    }
+    free(start);
+    free(next);
+    free(parent);
+    free(queue);
+}
+
+int diffHeapSnapshots(const char* beforePath, const char* afterPath) {
+    Snapshot before, after;
+    if (!readSnapshot(beforePath, &before, 0))
+        return 0;
+    if (!readSnapshot(afterPath, &after, 1)) {
+        freeSnapshot(&before);
+        return 0;
+    }
+    char bytes[32];
+    formatBytes((long long) after.bytes - (long long) before.bytes, bytes, sizeof(bytes));
+    printf("%+lld objects, %s from %s to %s\n", (long long) after.objects - (long long) before.objects, bytes, beforePath, afterPath);
+
+    int kindCount, siteCount;
+    Delta* kinds = diffGroups(&before.kinds, &after.kinds, &kindCount);
+    Delta* sites = diffGroups(&before.sites, &after.sites, &siteCount);
+    printDeltas("kinds", kinds, kindCount, kindCount);
+    printDeltas("allocation sites", sites, siteCount, SHOWN_SITES);
+    // a site that vanished from the later snapshot has nothing left to reach
+    if (siteCount > 0 && sites[0].bytes > 0 && strcmp(sites[0].group->name, "?") != 0
+            && sites[0].group >= after.sites.groups && sites[0].group < after.sites.groups + after.sites.count)
+        printRetainers(&after, (int) (sites[0].group - after.sites.groups));
+    free(kinds);
+    free(sites);
+    freeSnapshot(&before);
+    freeSnapshot(&after);
+    return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef heap_diff_h
+#define heap_diff_h
+
+// prints how the kinds and allocation sites of two heap snapshots grew, and how the objects of
+// the site that grew the most are reached in the later one; returns 0 if either cannot be read
+int diffHeapSnapshots(const char* beforePath, const char* afterPath);
+
+#endif
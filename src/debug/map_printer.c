@@ -9,22 +9,21 @@ void printEntry(Entry* entry) {
     dumpValue(entry->value);
 }
 
-static void printBucket(Entry* head) {
-    printf("    bucket:\n");
-    while (head != NULL) {
-        printf("    ");
-        printEntry(head);
+void printMap(HashMap* map) {
+    printf("{\n");
+    for (int i = 0; i < map->count; i++) {
+        printf("    entry %d: ", i);
+        printEntry(&map->entries[i]);
         printf(";\n");
-        head = head->next;
     }
+    printf("}\n");
 }
 
-void printMap(HashMap* map) {
+void printStringSet(StringSet* set) {
     printf("{\n");
-    for (int i = 0; i < map->capacity; i++) {
-        if (map->entries[i] != NULL) {
-            printBucket(map->entries[i]);
-        }
+    for (int i = 0; i < set->capacity; i++) {
+        if (string_set_slot_full(set, i))
+            printf("    slot %d: %s;\n", i, set->strings[i]->chars);
     }
     printf("}\n");
 }
@@ -2,9 +2,11 @@
 #define map_printer
 
 #include "../datastructs/hash_map.h"
+#include "../datastructs/string_set.h"
 #include "value_dump.h"
 
 void printEntry(Entry* entry);
 void printMap(HashMap* map);
+void printStringSet(StringSet* set);
 
 #endif
@@ -53,6 +53,7 @@ void printToken(Token tok) {
             TOKEN_PRINT_CASE(TOK_NIHL)
             TOKEN_PRINT_CASE(TOK_BREAK)
             TOKEN_PRINT_CASE(TOK_CONTINUE)
+            TOKEN_PRINT_CASE(TOK_YIELD)
             TOKEN_PRINT_CASE(TOK_INDENT)
             TOKEN_PRINT_CASE(TOK_DEDENT)
             TOKEN_PRINT_CASE(TOK_NEW_LINE)
@@ -27,7 +27,18 @@ static void dumpValue(Value val) {
 static void dumpObj(Obj* obj) {
     switch (obj->type) {
         case OBJ_STRING:
-            printf("%s", ((ObjString*) obj)->chars);
+            if (is_rope(obj)) {
+                ObjRope* rope = (ObjRope*) obj;
+                printf("rope(");
+                dumpObj((Obj*) rope->left);
+                if (rope->right != NULL) {
+                    printf(", ");
+                    dumpObj((Obj*) rope->right);
+                }
+                printf(")");
+            } else {
+                printf("%s", ((ObjString*) obj)->chars);
+            }
             break;
         case OBJ_FUNCTION:
             {
@@ -79,6 +90,16 @@ static void dumpObj(Obj* obj) {
                 printf("[dict %p]", (void*) obj);
                 break;
             }
+        case OBJ_CHANNEL:
+            {
+                printf("[channel %p]", (void*) obj);
+                break;
+            }
+        case OBJ_COROUTINE:
+            {
+                printf("[coroutine %p]", (void*) obj);
+                break;
+            }
     }
 }
 
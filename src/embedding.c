@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "embedding.h"
+#include "memory.h"
+#include "./compilation_pipeline/compiler.h"
+
+VM* vmNew(void) {
+    Collector* collector = (Collector*) malloc(sizeof(Collector));
+    VM* vm = (VM*) malloc(sizeof(VM));
+    if (collector == NULL || vm == NULL) {
+        free(collector);
+        free(vm);
+        return NULL;
+    }
+    initCollector(collector);
+    initVM(vm, collector);
+    return vm;
+}
+
+void vmFree(VM* vm) {
+    Collector* collector = vm->collector;
+    freeVM(vm);
+    free(collector);
+    free(vm);
+}
+
+ObjFunction* vmLoad(VM* vm, const char* source) {
+    // the compiler takes ownership of the source and expects it to end with a new line
+    size_t length = strlen(source);
+    char* buffer = (char*) malloc(length + 2);
+    if (buffer == NULL)
+        return NULL;
+    memcpy(buffer, source, length);
+    buffer[length] = '\n';
+    buffer[length + 1] = '\0';
+    Compiler compiler;
+    return compile(&compiler, vm->collector, buffer);
+}
+
+int vmInterpret(VM* vm, const char* source) {
+    ObjFunction* function = vmLoad(vm, source);
+    if (function == NULL)
+        return 0;
+    return vmExecute(vm, function);
+}
+
+int vmGetGlobal(VM* vm, const char* name, Value* result) {
+    ObjString* key = copyNoLengthString(vm->collector, (char*) name);
+    return mapGet(&vm->globals, to_vobj(key), result);
+}
@@ -0,0 +1,22 @@
+#ifndef embedding_h
+#define embedding_h
+
+#include "vm.h"
+
+// Embedding API: a VM created with vmNew keeps its globals, heap and compiled
+// code until vmFree, so scripts can be loaded once and called many times.
+//
+// Values handed back to the host (loaded functions, globals, call results) are
+// only guaranteed to live until the VM allocates again: pass them to vmRetain
+// to keep them across calls, and to vmRelease when done. A collector with compact
+// set moves objects between calls: hosts that enable it must read retained values
+// again from the script rather than keep their own copies. A string may be a
+// rope, whose characters are read through as_cstring rather than its chars field.
+
+VM* vmNew(void);
+void vmFree(VM* vm);
+int vmInterpret(VM* vm, const char* source);
+ObjFunction* vmLoad(VM* vm, const char* source);
+int vmGetGlobal(VM* vm, const char* name, Value* result);
+
+#endif
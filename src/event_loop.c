@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "event_loop.h"
+#include "memory.h"
+#include "vm.h"
+
+extern char** environ;
+
+typedef enum {
+    WAIT_TIMER,
+    WAIT_READ,
+    WAIT_EXIT,
+} WaitKind;
+
+struct sWaiter {
+    ObjCoroutine* task;
+    WaitKind kind;
+    int fd; // descriptor the operation waits on
+    int armed; // registered with the backend
+    pid_t pid; // child to reap once its output is read, -1 if none
+    int pidfd;
+    int capture; // the result is the output read rather than the exit status
+    int pollFirst; // a fifo reads as ended until a writer shows up
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    int status;
+    struct sWaiter* prev;
+    struct sWaiter* next;
+};
+
+#define READ_CHUNK 4096
+#define MAX_EVENTS 64
+
+/* backends: tell when a descriptor becomes readable, one notification per arm */
+
+#ifdef IO_URING
+
+#define RING_ENTRIES 256
+
+typedef struct {
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} Ring;
+
+static int backendOpen(EventLoop* loop) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (fd < 0)
+        return 0;
+    Ring* ring = (Ring*) malloc(sizeof(Ring));
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return 0;
+    }
+    char* sq = (char*) ring->sqRing;
+    char* cq = (char*) ring->cqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    loop->backend = fd;
+    loop->ring = ring;
+    return 1;
+}
+
+static void backendClose(EventLoop* loop) {
+    Ring* ring = (Ring*) loop->ring;
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    free(ring);
+    close(loop->backend);
+    loop->ring = NULL;
+    loop->backend = -1;
+}
+
+static int backendArm(EventLoop* loop, Waiter* waiter) {
+    Ring* ring = (Ring*) loop->ring;
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = waiter->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t) (uintptr_t) waiter;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, loop->backend, 1, 0, 0, NULL, 0) < 0)
+        return 0;
+    waiter->armed = 1;
+    return 1;
+}
+
+static void backendDisarm(EventLoop* loop, Waiter* waiter) {
+    // polls are one shot: a completed one leaves nothing behind
+    waiter->armed = 0;
+}
+
+static int backendWait(EventLoop* loop, Waiter** ready, int max) {
+    Ring* ring = (Ring*) loop->ring;
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, loop->backend, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            return 0;
+    }
+    int count = 0;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail && count < max) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+        ready[count++] = (Waiter*) (uintptr_t) cqe->user_data;
+        head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#else
+
+static int backendOpen(EventLoop* loop) {
+    loop->backend = epoll_create1(EPOLL_CLOEXEC);
+    return loop->backend >= 0;
+}
+
+static void backendClose(EventLoop* loop) {
+    close(loop->backend);
+    loop->backend = -1;
+}
+
+static int backendArm(EventLoop* loop, Waiter* waiter) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = waiter;
+    int op = waiter->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    // regular files can't be watched, they are read on the spot
+    if (epoll_ctl(loop->backend, op, waiter->fd, &event) < 0)
+        return 0;
+    waiter->armed = 1;
+    return 1;
+}
+
+static void backendDisarm(EventLoop* loop, Waiter* waiter) {
+    if (waiter->armed)
+        epoll_ctl(loop->backend, EPOLL_CTL_DEL, waiter->fd, NULL);
+    waiter->armed = 0;
+}
+
+static int backendWait(EventLoop* loop, Waiter** ready, int max) {
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->backend, events, max < MAX_EVENTS ? max : MAX_EVENTS, -1);
+    for (int i = 0; i < count; i++)
+        ready[i] = (Waiter*) events[i].data.ptr;
+    return count < 0 ? 0 : count;
+}
+
+#endif
+
+void initEventLoop(EventLoop* loop) {
+    loop->backend = -1;
+    loop->ring = NULL;
+    initValueArray(&loop->ready);
+    loop->readyHead = 0;
+    loop->waiters = NULL;
+    loop->waiting = 0;
+    loop->current = NULL;
+    loop->resumeDepth = 0;
+    loop->parked = 0;
+}
+
+static Waiter* newWaiter(WaitKind kind, int fd) {
+    Waiter* waiter = (Waiter*) malloc(sizeof(Waiter));
+    waiter->task = NULL;
+    waiter->kind = kind;
+    waiter->fd = fd;
+    waiter->armed = 0;
+    waiter->pid = -1;
+    waiter->pidfd = -1;
+    waiter->capture = 0;
+    waiter->pollFirst = 0;
+    waiter->buffer = NULL;
+    waiter->length = 0;
+    waiter->capacity = 0;
+    waiter->status = -1;
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    return waiter;
+}
+
+static void freeWaiter(Waiter* waiter) {
+    if (waiter->fd >= 0 && waiter->fd != waiter->pidfd)
+        close(waiter->fd);
+    if (waiter->pidfd >= 0)
+        close(waiter->pidfd);
+    free(waiter->buffer);
+    free(waiter);
+}
+
+static void unlinkWaiter(EventLoop* loop, Waiter* waiter) {
+    if (waiter->prev != NULL)
+        waiter->prev->next = waiter->next;
+    else
+        loop->waiters = waiter->next;
+    if (waiter->next != NULL)
+        waiter->next->prev = waiter->prev;
+    loop->waiting--;
+}
+
+// drops every task and pending operation, children are left to finish on their own
+void resetEventLoop(EventLoop* loop) {
+    while (loop->waiters != NULL) {
+        Waiter* waiter = loop->waiters;
+        unlinkWaiter(loop, waiter);
+        freeWaiter(waiter);
+    }
+    // pending io_uring polls still point to the freed waiters
+    if (loop->backend >= 0)
+        backendClose(loop);
+    loop->ready.count = 0;
+    loop->readyHead = 0;
+    loop->current = NULL;
+    loop->parked = 0;
+}
+
+void freeEventLoop(EventLoop* loop) {
+    resetEventLoop(loop);
+    freeValueArray(NULL, &loop->ready);
+}
+
+void markEventLoop(Collector* collector, EventLoop* loop) {
+    for (int i = loop->readyHead; i < loop->ready.count; i++)
+        markValue(collector, loop->ready.values[i]);
+    for (Waiter* waiter = loop->waiters; waiter != NULL; waiter = waiter->next)
+        markObject(collector, (Obj*) waiter->task);
+    markObject(collector, (Obj*) loop->current);
+}
+
+void forwardEventLoop(Compaction* compaction, EventLoop* loop) {
+    for (int i = loop->readyHead; i < loop->ready.count; i++)
+        forwardValue(compaction, &loop->ready.values[i]);
+    for (Waiter* waiter = loop->waiters; waiter != NULL; waiter = waiter->next)
+        waiter->task = (ObjCoroutine*) forwardObject(compaction, (Obj*) waiter->task);
+    loop->current = (ObjCoroutine*) forwardObject(compaction, (Obj*) loop->current);
+}
+
+// advances the operation without blocking, returns 1 once it completed
+static int stepWaiter(Waiter* waiter) {
+    switch (waiter->kind) {
+        case WAIT_TIMER:
+            {
+                uint64_t expirations;
+                if (read(waiter->fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+                    return 0;
+                return 1;
+            }
+        case WAIT_READ:
+            {
+                for (;;) {
+                    if (waiter->capacity - waiter->length < READ_CHUNK) {
+                        waiter->capacity = waiter->capacity * 2 + READ_CHUNK;
+                        waiter->buffer = realloc(waiter->buffer, waiter->capacity);
+                    }
+                    ssize_t count = read(waiter->fd, waiter->buffer + waiter->length, waiter->capacity - waiter->length);
+                    if (count > 0) {
+                        waiter->length += count;
+                    } else if (count < 0 && errno == EINTR) {
+                        continue;
+                    } else if (count < 0 && errno == EAGAIN) {
+                        return 0;
+                    } else {
+                        break; // end of file or error
+                    }
+                }
+                close(waiter->fd);
+                waiter->fd = -1;
+                waiter->armed = 0;
+                if (waiter->pid < 0)
+                    return 1;
+                // the output is closed, the child is about to exit
+                waiter->kind = WAIT_EXIT;
+                waiter->fd = waiter->pidfd;
+                return stepWaiter(waiter);
+            }
+        case WAIT_EXIT:
+            {
+                int status;
+                // without a pidfd there is nothing to watch: reap synchronously
+                pid_t reaped = waitpid(waiter->pid, &status, waiter->pidfd >= 0 ? WNOHANG : 0);
+                if (reaped == 0 || (reaped < 0 && errno == EINTR))
+                    return 0;
+                waiter->status = reaped > 0 ? status : -1;
+                return 1;
+            }
+    }
+    return 1;
+}
+
+static void driveWaiter(Waiter* waiter) {
+    do {
+        if (waiter->fd < 0)
+            continue;
+        struct pollfd pollfd = {waiter->fd, POLLIN, 0};
+        poll(&pollfd, 1, -1);
+    } while (!stepWaiter(waiter));
+}
+
+static Value waiterResult(VM* vm, Waiter* waiter) {
+    if (waiter->capture)
+        return to_vobj(copyString(vm->collector, waiter->length > 0 ? waiter->buffer : "", waiter->length));
+    if (waiter->kind == WAIT_EXIT)
+        return to_vnumber(waiter->status);
+    return to_vnihl();
+}
+
+static int canPark(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    // only the task itself may park, not code it runs through a nested vmCall
+    return loop->current != NULL && vm->fiber == &loop->current->fiber && vm->runDepth == loop->resumeDepth
+        && (loop->backend >= 0 || backendOpen(loop));
+}
+
+// completes the operation, parking the current task while it is pending
+static Value awaitWaiter(VM* vm, Waiter* waiter) {
+    EventLoop* loop = &vm->loop;
+    if (waiter->pollFirst || !stepWaiter(waiter)) {
+        if (waiter->fd >= 0 && canPark(vm) && backendArm(loop, waiter)) {
+            waiter->task = loop->current;
+            waiter->next = loop->waiters;
+            if (loop->waiters != NULL)
+                loop->waiters->prev = waiter;
+            loop->waiters = waiter;
+            loop->waiting++;
+            loop->parked = 1;
+            // placeholder for the result, filled in when the task is resumed
+            return to_vnihl();
+        }
+        driveWaiter(waiter);
+    }
+    Value result = waiterResult(vm, waiter);
+    freeWaiter(waiter);
+    return result;
+}
+
+static void enqueue(VM* vm, Value task) {
+    EventLoop* loop = &vm->loop;
+    pushSafe(vm->collector, task);
+    writeValueArray(vm->collector, &loop->ready, task);
+    popSafe(vm->collector);
+}
+
+// task is a coroutine or a function without arguments, which then runs as a coroutine
+Value loopSpawn(VM* vm, Value task) {
+    if (is_closure(task) && as_closure(task)->function->arity == 0)
+        task = to_vobj(newCoroutine(vm->collector, as_closure(task), &task, 1));
+    if (!is_coroutine(task))
+        return to_vobj(newErrorFromCharArray(vm->collector, "only coroutines and functions without arguments can be spawned"));
+    if (as_coroutine(task)->fiber.state != FIBER_SUSPENDED)
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot spawn a running or finished coroutine"));
+    enqueue(vm, task);
+    return task;
+}
+
+static void pollWaiters(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    Waiter* ready[MAX_EVENTS];
+    int count = backendWait(loop, ready, MAX_EVENTS);
+    for (int i = 0; i < count; i++) {
+        Waiter* waiter = ready[i];
+        if (!stepWaiter(waiter)) {
+            if (waiter->fd >= 0 && !backendArm(loop, waiter))
+                driveWaiter(waiter);
+            else
+                continue;
+        }
+        backendDisarm(loop, waiter);
+        ObjCoroutine* task = waiter->task;
+        // the waiter keeps the task rooted while the result is allocated
+        task->fiber.sp[-1] = waiterResult(vm, waiter);
+        write_barrier(vm->collector, task, task->fiber.sp[-1]);
+        unlinkWaiter(loop, waiter);
+        freeWaiter(waiter);
+        enqueue(vm, to_vobj(task));
+    }
+}
+
+// resumes tasks in turn until all of them finish, returns 0 on a runtime error
+int loopRun(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    while (loop->readyHead < loop->ready.count || loop->waiting > 0) {
+        if (loop->readyHead == loop->ready.count) {
+            pollWaiters(vm);
+            continue;
+        }
+        if (vm->collector->nurseryFull)
+            vmEvacuate(vm);
+        if (vm->collector->compactPending)
+            vmCompact(vm);
+        Value task = loop->ready.values[loop->readyHead++];
+        if (loop->readyHead == loop->ready.count)
+            loop->ready.count = loop->readyHead = 0;
+        if (as_coroutine(task)->fiber.state != FIBER_SUSPENDED)
+            continue;
+        loop->current = as_coroutine(task);
+        loop->resumeDepth = vm->runDepth + 1;
+        Value result;
+        int ok = vmCall(vm, task, 0, NULL, &result);
+        loop->current = NULL;
+        if (!ok)
+            return 0;
+        if (loop->parked) {
+            loop->parked = 0;
+        } else if (as_coroutine(task)->fiber.state != FIBER_DONE) {
+            // a plain yield lets the other tasks run
+            enqueue(vm, task);
+        }
+    }
+    return 1;
+}
+
+Value loopSleep(VM* vm, double seconds) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot create timer"));
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t) seconds;
+    spec.it_value.tv_nsec = (long) ((seconds - (double) spec.it_value.tv_sec) * 1e9);
+    // a zero timer is disarmed, wait at least a nanosecond
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec <= 0)
+        spec.it_value.tv_nsec = 1;
+    timerfd_settime(fd, 0, &spec, NULL);
+    return awaitWaiter(vm, newWaiter(WAIT_TIMER, fd));
+}
+
+Value loopReadFile(VM* vm, const char* path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot open file"));
+    Waiter* waiter = newWaiter(WAIT_READ, fd);
+    waiter->capture = 1;
+    struct stat info;
+    waiter->pollFirst = fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode);
+    return awaitWaiter(vm, waiter);
+}
+
+// runs command through the shell, resulting in its output if capture is set, in its exit status otherwise
+Value loopExec(VM* vm, const char* command, int capture) {
+    int pipefd[2] = {-1, -1};
+    if (capture && pipe2(pipefd, O_CLOEXEC) < 0)
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot create pipe"));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (capture)
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    char* argv[] = {"sh", "-c", (char*) command, NULL};
+    pid_t pid;
+    // flush so the child's output comes after ours
+    fflush(stdout);
+    int failed = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (capture)
+        close(pipefd[1]);
+    if (failed) {
+        if (capture)
+            close(pipefd[0]);
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot run command"));
+    }
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    Waiter* waiter;
+    if (capture) {
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        waiter = newWaiter(WAIT_READ, pipefd[0]);
+        waiter->capture = 1;
+    } else {
+        waiter = newWaiter(WAIT_EXIT, pidfd);
+    }
+    waiter->pid = pid;
+    waiter->pidfd = pidfd;
+    return awaitWaiter(vm, waiter);
+}
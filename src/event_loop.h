@@ -0,0 +1,34 @@
+#ifndef event_loop_h
+#define event_loop_h
+
+#include "./commontypes.h"
+#include "./datastructs/value.h"
+#include "./compact.h"
+
+typedef struct sWaiter Waiter;
+
+// runs spawned coroutines (tasks), parking them while their I/O is pending
+typedef struct {
+    int backend; // epoll or io_uring descriptor, -1 until first needed
+    void* ring; // io_uring mappings
+    ValueArray ready; // tasks to resume, in order
+    int readyHead;
+    Waiter* waiters; // parked tasks and the operation they wait for
+    int waiting;
+    ObjCoroutine* current; // task being resumed by loopRun
+    int resumeDepth; // vmCall nesting at which current may park
+    int parked; // set when current must yield back to the scheduler
+} EventLoop;
+
+void initEventLoop(EventLoop* loop);
+void freeEventLoop(EventLoop* loop);
+void resetEventLoop(EventLoop* loop);
+void markEventLoop(Collector* collector, EventLoop* loop);
+void forwardEventLoop(Compaction* compaction, EventLoop* loop);
+Value loopSpawn(VM* vm, Value task);
+int loopRun(VM* vm);
+Value loopSleep(VM* vm, double seconds);
+Value loopReadFile(VM* vm, const char* path);
+Value loopExec(VM* vm, const char* command, int capture);
+
+#endif
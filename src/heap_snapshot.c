@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heap_snapshot.h"
+#include "memory.h"
+#include "util.h"
+
+unsigned heapSnapshotGeneration = 0;
+
+void requestHeapSnapshot(int signal) {
+    (void) signal;
+    __atomic_add_fetch(&heapSnapshotGeneration, 1, __ATOMIC_RELAXED);
+}
+
+// open addressing from objects to integers, with linear probing
+typedef struct {
+    Obj** keys;
+    int* values;
+    size_t count;
+    size_t capacity; // a power of two
+} ObjectTable;
+
+static size_t findSlot(ObjectTable* table, Obj* object) {
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_pointer(object) & mask;
+    while (table->keys[slot] != NULL && table->keys[slot] != object)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static int tableGet(ObjectTable* table, Obj* object) {
+    if (table->count == 0)
+        return -1;
+    size_t slot = findSlot(table, object);
+    return table->keys[slot] == NULL ? -1 : table->values[slot];
+}
+
+static void tablePut(ObjectTable* table, Obj* object, int value) {
+    if (2 * (table->count + 1) > table->capacity) {
+        ObjectTable grown = {.count = table->count, .capacity = table->capacity < 64 ? 64 : table->capacity * 2};
+        grown.keys = (Obj**) calloc(grown.capacity, sizeof(Obj*));
+        grown.values = (int*) malloc(sizeof(int) * grown.capacity);
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->keys[i] == NULL)
+                continue;
+            size_t slot = findSlot(&grown, table->keys[i]);
+            grown.keys[slot] = table->keys[i];
+            grown.values[slot] = table->values[i];
+        }
+        free(table->keys);
+        free(table->values);
+        *table = grown;
+    }
+    size_t slot = findSlot(table, object);
+    if (table->keys[slot] == NULL)
+        table->count++;
+    table->keys[slot] = object;
+    table->values[slot] = value;
+}
+
+static void tableRemove(ObjectTable* table, Obj* object) {
+    if (table->count == 0)
+        return;
+    size_t mask = table->capacity - 1;
+    size_t slot = findSlot(table, object);
+    if (table->keys[slot] == NULL)
+        return;
+    table->count--;
+    // the entries probed past the emptied slot move back into it, so that no probe stops short
+    for (size_t next = slot;;) {
+        table->keys[slot] = NULL;
+        for (;;) {
+            next = (next + 1) & mask;
+            if (table->keys[next] == NULL)
+                return;
+            size_t home = hash_pointer(table->keys[next]) & mask;
+            if (next > slot ? (home <= slot || home > next) : (home <= slot && home > next))
+                break;
+        }
+        table->keys[slot] = table->keys[next];
+        table->values[slot] = table->values[next];
+        slot = next;
+    }
+}
+
+static void freeTable(ObjectTable* table) {
+    free(table->keys);
+    free(table->values);
+}
+
+typedef struct {
+    char* function;
+    int line;
+} AllocSite;
+
+// allocating instructions seen lately, so that a loop finds its site without decoding lines
+#define SITE_CACHE_SIZE 256
+
+struct sAllocSites {
+    ObjectTable objects; // the site of every object allocated since tracking started
+    AllocSite* sites;
+    int count;
+    int capacity;
+    int* index; // sites by function and line, -1 for empty slots
+    int indexCapacity;
+    struct {
+        uint8_t* pc;
+        int site;
+    } cache[SITE_CACHE_SIZE];
+};
+
+void trackAllocationSites(Collector* collector) {
+    AllocSites* sites = (AllocSites*) calloc(1, sizeof(AllocSites));
+    if (sites == NULL)
+        return;
+    collector->sites = sites;
+}
+
+static uint32_t hashSite(const char* function, int line) {
+    return hash_string((char*) function, strlen(function)) ^ hash_int(line);
+}
+
+static int findSite(AllocSites* sites, const char* function, int line) {
+    if (2 * (sites->count + 1) > sites->indexCapacity) {
+        free(sites->index);
+        sites->indexCapacity = sites->indexCapacity < 64 ? 64 : sites->indexCapacity * 2;
+        sites->index = (int*) malloc(sizeof(int) * sites->indexCapacity);
+        memset(sites->index, -1, sizeof(int) * sites->indexCapacity);
+        for (int i = 0; i < sites->count; i++) {
+            int slot = hashSite(sites->sites[i].function, sites->sites[i].line) & (sites->indexCapacity - 1);
+            while (sites->index[slot] >= 0)
+                slot = (slot + 1) & (sites->indexCapacity - 1);
+            sites->index[slot] = i;
+        }
+    }
+    int slot = hashSite(function, line) & (sites->indexCapacity - 1);
+    for (; sites->index[slot] >= 0; slot = (slot + 1) & (sites->indexCapacity - 1)) {
+        AllocSite* site = &sites->sites[sites->index[slot]];
+        if (site->line == line && strcmp(site->function, function) == 0)
+            return sites->index[slot];
+    }
+    if (sites->count == sites->capacity) {
+        sites->capacity = compute_capacity(sites->capacity);
+        sites->sites = (AllocSite*) realloc(sites->sites, sizeof(AllocSite) * sites->capacity);
+    }
+    sites->sites[sites->count] = (AllocSite) {.function = strdup(function), .line = line};
+    sites->index[slot] = sites->count;
+    return sites->count++;
+}
+
+void recordAllocation(Collector* collector, Obj* object) {
+    VM* vm = collector->vm;
+    AllocSites* sites = collector->sites;
+    int site;
+    if (vm == NULL || vm->fp == 0) {
+        site = findSite(sites, "<compiler>", 0);
+    } else {
+        CallFrame* frame = &vm->frames[vm->fp - 1];
+        size_t slot = hash_pointer(frame->pc) % SITE_CACHE_SIZE;
+        if (sites->cache[slot].pc == frame->pc) {
+            site = sites->cache[slot].site;
+        } else {
+            ObjString* name = frame->closure->function->name;
+            site = findSite(sites, name != NULL ? name->chars : "<script>", vmCurrentLine(vm));
+            sites->cache[slot].pc = frame->pc;
+            sites->cache[slot].site = site;
+        }
+    }
+    tablePut(&sites->objects, object, site);
+}
+
+void forgetAllocation(Collector* collector, Obj* object) {
+    AllocSites* sites = collector->sites;
+    tableRemove(&sites->objects, object);
+    // a function allocated later may reuse the code buffer of this one
+    if (object->type == OBJ_FUNCTION)
+        memset(sites->cache, 0, sizeof(sites->cache));
+}
+
+void moveAllocation(Collector* collector, Obj* from, Obj* to) {
+    AllocSites* sites = collector->sites;
+    int site = tableGet(&sites->objects, from);
+    if (site < 0)
+        return;
+    tableRemove(&sites->objects, from);
+    tablePut(&sites->objects, to, site);
+}
+
+void freeAllocationSites(Collector* collector) {
+    AllocSites* sites = collector->sites;
+    if (sites == NULL)
+        return;
+    for (int i = 0; i < sites->count; i++)
+        free(sites->sites[i].function);
+    free(sites->sites);
+    free(sites->index);
+    freeTable(&sites->objects);
+    free(sites);
+    collector->sites = NULL;
+}
+
+// node 0 stands for the roots, node i for objects[i - 1]
+struct sHeapSnapshot {
+    ObjectTable nodes;
+    Obj** objects;
+    int count;
+    int capacity;
+    int* from;
+    int* to;
+    size_t edgeCount;
+    size_t edgeCapacity;
+    int current; // the node whose references are being walked
+};
+
+void snapshotReference(HeapSnapshot* snapshot, Obj* object) {
+    int node = tableGet(&snapshot->nodes, object);
+    if (node < 0) {
+        if (snapshot->count == snapshot->capacity) {
+            snapshot->capacity = compute_capacity(snapshot->capacity);
+            snapshot->objects = (Obj**) realloc(snapshot->objects, sizeof(Obj*) * snapshot->capacity);
+        }
+        snapshot->objects[snapshot->count++] = object;
+        node = snapshot->count;
+        tablePut(&snapshot->nodes, object, node);
+    }
+    if (snapshot->edgeCount == snapshot->edgeCapacity) {
+        snapshot->edgeCapacity = compute_capacity(snapshot->edgeCapacity);
+        snapshot->from = (int*) realloc(snapshot->from, sizeof(int) * snapshot->edgeCapacity);
+        snapshot->to = (int*) realloc(snapshot->to, sizeof(int) * snapshot->edgeCapacity);
+    }
+    snapshot->from[snapshot->edgeCount] = snapshot->current;
+    snapshot->to[snapshot->edgeCount++] = node;
+}
+
+// the references of each node, in CSR form: those of node i are list[start[i]] to list[start[i + 1]]
+static void buildAdjacency(int nodes, int* from, int* to, size_t edges, size_t** start, int** list) {
+    *start = (size_t*) calloc(nodes + 1, sizeof(size_t));
+    *list = (int*) malloc(sizeof(int) * (edges > 0 ? edges : 1));
+    for (size_t i = 0; i < edges; i++)
+        (*start)[from[i] + 1]++;
+    for (int i = 0; i < nodes; i++)
+        (*start)[i + 1] += (*start)[i];
+    size_t* fill = (size_t*) malloc(sizeof(size_t) * nodes);
+    memcpy(fill, *start, sizeof(size_t) * nodes);
+    for (size_t i = 0; i < edges; i++)
+        (*list)[fill[from[i]]++] = to[i];
+    free(fill);
+}
+
+static int intersect(int* idom, int* post, int a, int b) {
+    while (a != b) {
+        while (post[a] < post[b])
+            a = idom[a];
+        while (post[b] < post[a])
+            b = idom[b];
+    }
+    return a;
+}
+
+// an object retains the bytes of the objects that every path from the roots goes through it
+// to reach; found with the iterative dominator algorithm of Cooper, Harvey and Kennedy
+static void computeDominators(int nodes, size_t* succStart, int* succ, size_t* predStart, int* pred, int* idom, int* order) {
+    int* post = (int*) malloc(sizeof(int) * nodes);
+    int* stack = (int*) malloc(sizeof(int) * nodes);
+    size_t* cursor = (size_t*) malloc(sizeof(size_t) * nodes);
+    char* seen = (char*) calloc(nodes, 1);
+    memcpy(cursor, succStart, sizeof(size_t) * nodes);
+    int depth = 0, visited = 0;
+    stack[depth++] = 0;
+    seen[0] = 1;
+    while (depth > 0) {
+        int node = stack[depth - 1];
+        if (cursor[node] < succStart[node + 1]) {
+            int next = succ[cursor[node]++];
+            if (!seen[next]) {
+                seen[next] = 1;
+                stack[depth++] = next;
+            }
+        } else {
+            depth--;
+            post[node] = visited;
+            order[visited++] = node;
+        }
+    }
+    for (int i = 0; i < nodes; i++)
+        idom[i] = -1;
+    idom[0] = 0;
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int i = nodes - 2; i >= 0; i--) {
+            int node = order[i];
+            int dominator = -1;
+            for (size_t p = predStart[node]; p < predStart[node + 1]; p++) {
+                if (idom[pred[p]] < 0)
+                    continue;
+                dominator = dominator < 0 ? pred[p] : intersect(idom, post, pred[p], dominator);
+            }
+            if (idom[node] != dominator) {
+                idom[node] = dominator;
+                changed = 1;
+            }
+        }
+    }
+    free(post);
+    free(stack);
+    free(cursor);
+    free(seen);
+}
+
+// adds the bytes retained by each group of objects: those of its members that no other member dominates
+static void sumGroups(int nodes, int* idom, size_t* retained, int* group, int groups, size_t* groupRetained) {
+    size_t* start;
+    int* children;
+    int* parent = (int*) malloc(sizeof(int) * nodes);
+    int* child = (int*) malloc(sizeof(int) * nodes);
+    for (int i = 1; i < nodes; i++) {
+        parent[i - 1] = idom[i];
+        child[i - 1] = i;
+    }
+    buildAdjacency(nodes, parent, child, nodes - 1, &start, &children);
+    free(parent);
+    free(child);
+    int* open = (int*) calloc(groups, sizeof(int)); // members on the path from the roots
+    int* stack = (int*) malloc(sizeof(int) * 2 * nodes);
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        int node = stack[--depth];
+        if (node < 0) {
+            open[group[~node]]--;
+            continue;
+        }
+        if (node > 0) {
+            if (open[group[node]]++ == 0)
+                groupRetained[group[node]] += retained[node];
+            stack[depth++] = ~node;
+        }
+        for (size_t c = start[node]; c < start[node + 1]; c++)
+            stack[depth++] = children[c];
+    }
+    free(open);
+    free(stack);
+    free(start);
+    free(children);
+}
+
+static const char* siteName(AllocSites* sites, int site, int* line) {
+    if (sites == NULL || site < 0 || site >= sites->count) {
+        *line = 0;
+        return "?";
+    }
+    *line = sites->sites[site].line;
+    return sites->sites[site].function;
+}
+
+int writeHeapSnapshot(Collector* collector, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return 0;
+
+    // walk the heap from the roots through a view of the collector whose marking records references
+    HeapSnapshot snapshot = {0};
+    Collector view = *collector;
+    view.snapshot = &snapshot;
+    markRoots(&view);
+    for (int i = 0; i < snapshot.count; i++) {
+        snapshot.current = i + 1;
+        blackenObject(&view, snapshot.objects[i]);
+    }
+
+    int nodes = snapshot.count + 1;
+    AllocSites* sites = collector->sites;
+    int siteGroups = (sites != NULL ? sites->count : 0) + 1; // the last one for unknown sites
+    size_t* size = (size_t*) malloc(sizeof(size_t) * nodes);
+    size_t* retained = (size_t*) malloc(sizeof(size_t) * nodes);
+    int* kind = (int*) malloc(sizeof(int) * nodes);
+    int* site = (int*) malloc(sizeof(int) * nodes);
+    size[0] = retained[0] = 0;
+    kind[0] = site[0] = 0;
+    for (int i = 1; i < nodes; i++) {
+        Obj* object = snapshot.objects[i - 1];
+        size[i] = retained[i] = objectSize(object);
+        kind[i] = object->type;
+        site[i] = sites != NULL ? tableGet(&sites->objects, object) : -1;
+        if (site[i] < 0)
+            site[i] = siteGroups - 1;
+    }
+
+    size_t *succStart, *predStart;
+    int *succ, *pred;
+    buildAdjacency(nodes, snapshot.from, snapshot.to, snapshot.edgeCount, &succStart, &succ);
+    buildAdjacency(nodes, snapshot.to, snapshot.from, snapshot.edgeCount, &predStart, &pred);
+    int* idom = (int*) malloc(sizeof(int) * nodes);
+    int* order = (int*) malloc(sizeof(int) * nodes);
+    computeDominators(nodes, succStart, succ, predStart, pred, idom, order);
+    // postorder visits the objects an object dominates before it
+    for (int i = 0; i < nodes - 1; i++)
+        retained[idom[order[i]]] += retained[order[i]];
+
+    size_t kindCount[OBJ_KINDS] = {0}, kindBytes[OBJ_KINDS] = {0}, kindRetained[OBJ_KINDS] = {0};
+    size_t* siteCount = (size_t*) calloc(siteGroups, sizeof(size_t));
+    size_t* siteBytes = (size_t*) calloc(siteGroups, sizeof(size_t));
+    size_t* siteRetained = (size_t*) calloc(siteGroups, sizeof(size_t));
+    for (int i = 1; i < nodes; i++) {
+        kindCount[kind[i]]++;
+        kindBytes[kind[i]] += size[i];
+        siteCount[site[i]]++;
+        siteBytes[site[i]] += size[i];
+    }
+    sumGroups(nodes, idom, retained, kind, OBJ_KINDS, kindRetained);
+    sumGroups(nodes, idom, retained, site, siteGroups, siteRetained);
+
+    fprintf(file, "lanthanum heap snapshot\n");
+    fprintf(file, "total %d %zu\n", snapshot.count, retained[0]);
+    for (int i = 0; i < (int) OBJ_KINDS; i++) {
+        if (kindCount[i] > 0)
+            fprintf(file, "kind %s %zu %zu %zu\n", kindName(i), kindCount[i], kindBytes[i], kindRetained[i]);
+    }
+    for (int i = 0; i < siteGroups; i++) {
+        int line;
+        const char* function = siteName(i < siteGroups - 1 ? sites : NULL, i, &line);
+        if (siteCount[i] > 0)
+            fprintf(file, "site %d %s %d %zu %zu %zu\n", i, function, line, siteCount[i], siteBytes[i], siteRetained[i]);
+    }
+    for (int i = 1; i < nodes; i++)
+        fprintf(file, "object %d %s %zu %d\n", i - 1, kindName(kind[i]), size[i], site[i]);
+    for (size_t i = 0; i < snapshot.edgeCount; i++) {
+        if (snapshot.from[i] == 0)
+            fprintf(file, "root %d\n", snapshot.to[i] - 1);
+        else
+            fprintf(file, "ref %d %d\n", snapshot.from[i] - 1, snapshot.to[i] - 1);
+    }
+    int written = !ferror(file);
+    written &= fclose(file) == 0;
+
+    free(size);
+    free(retained);
+    free(kind);
+    free(site);
+    free(succStart);
+    free(succ);
+    free(predStart);
+    free(pred);
+    free(idom);
+    free(order);
+    free(siteCount);
+    free(siteBytes);
+    free(siteRetained);
+    freeTable(&snapshot.nodes);
+    free(snapshot.objects);
+    free(snapshot.from);
+    free(snapshot.to);
+    return written;
+}
+
+void writeRequestedSnapshot(Collector* collector) {
+    static int written = 0;
+    collector->snapshotGeneration = __atomic_load_n(&heapSnapshotGeneration, __ATOMIC_RELAXED);
+    char path[64];
+    snprintf(path, sizeof(path), "lanthanum-%d-%d.heap", (int) getpid(), __atomic_add_fetch(&written, 1, __ATOMIC_RELAXED));
+    if (writeHeapSnapshot(collector, path))
+        fprintf(stderr, "heap snapshot written to %s\n", path);
+    else
+        fprintf(stderr, "cannot write heap snapshot to %s\n", path);
+}
@@ -0,0 +1,31 @@
+#ifndef heap_snapshot_h
+#define heap_snapshot_h
+
+#include "./commontypes.h"
+#include "./datastructs/value.h"
+
+typedef struct sAllocSites AllocSites;
+typedef struct sHeapSnapshot HeapSnapshot;
+
+// bumped by the SIGUSR1 handler: every VM, one per job, writes a snapshot at its next call or
+// backward jump once it sees a generation it has not written yet
+extern unsigned heapSnapshotGeneration;
+void requestHeapSnapshot(int signal);
+
+// remembers the function and line that allocate each object from now on
+void trackAllocationSites(Collector* collector);
+void recordAllocation(Collector* collector, Obj* object);
+void forgetAllocation(Collector* collector, Obj* object);
+// keeps the site of an object moved by compaction
+void moveAllocation(Collector* collector, Obj* from, Obj* to);
+void freeAllocationSites(Collector* collector);
+
+// called by markObject on the view of the collector that walks the heap for a snapshot
+void snapshotReference(HeapSnapshot* snapshot, Obj* object);
+// writes the objects reachable from the roots, grouped by kind and by allocation site with the
+// bytes each group retains, and the references between them; returns 0 if path cannot be written
+int writeHeapSnapshot(Collector* collector, const char* path);
+// writes lanthanum-<pid>-<n>.heap in the working directory and reports it on stderr
+void writeRequestedSnapshot(Collector* collector);
+
+#endif
@@ -1,16 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/random.h>
 
 #include "./memory.h"
 #include "vm.h"
+#include "embedding.h"
+#include "parallel_mark.h"
+#include "heap_snapshot.h"
+#include "./debug/heap_diff.h"
+#include "./util.h"
+#include "./datastructs/channel.h"
 #include "./compilation_pipeline/compiler.h"
 
 static char* readFile(const char* path) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {                                      
         fprintf(stderr, "cannot open file at path \"%s\"\n", path);
-        exit(1);                                              
+        return NULL;
     }   
 
     fseek(file, 0L, SEEK_END);                                     
@@ -20,12 +31,15 @@ static char* readFile(const char* path) {
     char* buffer = (char*) malloc(fileSize + 2); // + 2 because we have to append \n and \0                     
     if (buffer == NULL) {                                          
         fprintf(stderr, "have not enough memory to read file at path \"%s\"\n", path);
-        exit(1);                                                    
+        fclose(file);
+        return NULL;
     } 
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {                                    
         fprintf(stderr, "cannot read file at path \"%s\"\n", path);      
-        exit(1);       
+        free(buffer);
+        fclose(file);
+        return NULL;
     }
     buffer[bytesRead] = '\n';
     buffer[bytesRead + 1] = '\0';                                      
@@ -34,28 +48,346 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* fname, VM* vm, Compiler* compiler, Collector* collector) {
+// collector settings given on the command line, applied to every VM
+typedef struct {
+    long pauseBudget;
+    int markThreads; // 0 keeps the collector default
+    size_t initialHeap;
+    double growthFactor;
+    size_t targetHeap;
+    size_t heapLimit;
+    int allocationSites;
+    int compact;
+    int stats;
+} GCOptions;
+
+static GCOptions gcOptions = {
+    .pauseBudget = DEFAULT_PAUSE_BUDGET_US, .markThreads = 0, .initialHeap = BASE_TRIGGER_GC_THRESHOLD,
+    .growthFactor = GC_TRESHOLD_FACTOR, .targetHeap = 0, .heapLimit = 0, .allocationSites = 0, .compact = 0, .stats = 0
+};
+
+static void applyGCOptions(Collector* collector) {
+    collector->pauseBudget = gcOptions.pauseBudget;
+    if (gcOptions.markThreads > 0)
+        collector->markThreads = gcOptions.markThreads;
+    collector->initialHeap = gcOptions.initialHeap;
+    collector->triggerGCThreshold = gcOptions.initialHeap;
+    collector->growthFactor = gcOptions.growthFactor;
+    collector->targetHeap = gcOptions.targetHeap;
+    collector->heapLimit = gcOptions.heapLimit;
+    if (gcOptions.allocationSites)
+        trackAllocationSites(collector);
+    collector->compact = gcOptions.compact;
+}
+
+static int runFile(const char* fname, VM* vm, Compiler* compiler, Collector* collector) {
     char* source = readFile(fname);
+    if (source == NULL) {
+        return 0;
+    }
     ObjFunction* function = compile(compiler, collector, source);
     if (function == NULL) { // compile error
+        return 0;
+    }
+    return vmExecute(vm, function);
+}
+
+typedef struct {
+    char** files;
+    int count;
+    int next;
+    int failures;
+    pthread_mutex_t lock;
+} Batch;
+
+// every script of a batch gets its own VM and collector, nothing is shared between workers
+static int runIsolatedFile(const char* fname) {
+    char* source = readFile(fname);
+    if (source == NULL)
+        return 0;
+    VM* vm = vmNew();
+    if (vm == NULL) {
+        fprintf(stderr, "have not enough memory to run file at path \"%s\"\n", fname);
+        free(source);
+        return 0;
+    }
+    applyGCOptions(vm->collector);
+    Compiler compiler;
+    ObjFunction* function = compile(&compiler, vm->collector, source);
+    int result = function != NULL && vmExecute(vm, function);
+    if (gcOptions.stats)
+        reportPauses(vm->collector, fname);
+    vmFree(vm);
+    return result;
+}
+
+static void* batchWorker(void* arg) {
+    Batch* batch = (Batch*) arg;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (index >= batch->count)
+            break;
+        if (!runIsolatedFile(batch->files[index])) {
+            pthread_mutex_lock(&batch->lock);
+            batch->failures++;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    return NULL;
+}
+
+static int runBatch(char** files, int count, int jobs) {
+    Batch batch = {.files = files, .count = count, .next = 0, .failures = 0};
+    pthread_mutex_init(&batch.lock, NULL);
+    if (jobs > count)
+        jobs = count;
+    pthread_t* workers = (pthread_t*) malloc(sizeof(pthread_t) * jobs);
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, batchWorker, &batch) != 0)
+            break;
+    }
+    if (started == 0) // no threads available: run the batch on the main thread
+        batchWorker(&batch);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.failures;
+}
+
+static int startsBlock(const char* line) {
+    static const char* blockKeywords[] = {"if", "elif", "else", "while", "func", NULL};
+    while (*line == ' ' || *line == '\t')
+        line++;
+    for (const char** kw = blockKeywords; *kw != NULL; kw++) {
+        size_t length = strlen(*kw);
+        if (strncmp(line, *kw, length) == 0 && !isalnum(line[length]) && line[length] != '_')
+            return 1;
+    }
+    return 0;
+}
+
+static int isBlankLine(const char* line) {
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return *line == '\n' || *line == '\0';
+}
+
+// the chunk is incomplete while a string or a bracket is still open
+static int isOpenChunk(const char* chunk) {
+    int depth = 0;
+    char quote = '\0';
+    for (; *chunk != '\0'; chunk++) {
+        if (quote != '\0') {
+            if (*chunk == quote)
+                quote = '\0';
+        } else if (*chunk == '\'' || *chunk == '"') {
+            quote = *chunk;
+        } else if (*chunk == '(' || *chunk == '[' || *chunk == '{') {
+            depth++;
+        } else if (*chunk == ')' || *chunk == ']' || *chunk == '}') {
+            depth--;
+        }
+    }
+    return quote != '\0' || depth > 0;
+}
+
+static char* appendLine(char* chunk, size_t* length, const char* line, size_t lineLength) {
+    // + 2 because a missing final \n has to be appended along with \0
+    chunk = (char*) realloc(chunk, *length + lineLength + 2);
+    if (chunk == NULL) {
+        fprintf(stderr, "have not enough memory to read input\n");
         exit(1);
     }
-    int runtimeResult = vmExecute(vm, collector, function);
-    if (!runtimeResult) { // runtime error
-        exit(1); 
+    memcpy(chunk + *length, line, lineLength);
+    *length += lineLength;
+    if (*length == 0 || chunk[*length - 1] != '\n')
+        chunk[(*length)++] = '\n';
+    chunk[*length] = '\0';
+    return chunk;
+}
+
+static void repl(VM* vm, Compiler* compiler, Collector* collector) {
+    int interactive = isatty(fileno(stdin));
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    for (;;) {
+        if (interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
+        if ((lineLength = getline(&line, &lineCapacity, stdin)) < 0)
+            break;
+        if (isBlankLine(line))
+            continue;
+        size_t chunkLength = 0;
+        char* chunk = appendLine(NULL, &chunkLength, line, lineLength);
+        // compound statements go on until an empty line, like in python
+        int inBlock = startsBlock(line);
+        while (isOpenChunk(chunk) || inBlock) {
+            if (interactive) {
+                printf("... ");
+                fflush(stdout);
+            }
+            if ((lineLength = getline(&line, &lineCapacity, stdin)) < 0)
+                break;
+            if (inBlock && isBlankLine(line))
+                break;
+            chunk = appendLine(chunk, &chunkLength, line, lineLength);
+        }
+        // the compiler takes ownership of the chunk, globals and heap persist across chunks
+        ObjFunction* function = compile(compiler, collector, chunk);
+        if (function != NULL)
+            vmExecute(vm, function);
+        if (lineLength < 0)
+            break;
+    }
+    if (interactive)
+        printf("\n");
+    free(line);
+}
+
+// consumes the collector options in front of argv, returns how many arguments they took
+// a number of bytes, with an optional K, M or G suffix
+static int parseSize(const char* arg, size_t* size) {
+    char* end;
+    double value = strtod(arg, &end);
+    double unit = 1;
+    switch (*end) {
+        case 'k': case 'K': unit = 1024; end++; break;
+        case 'm': case 'M': unit = 1024 * 1024; end++; break;
+        case 'g': case 'G': unit = 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == arg || *end != '\0' || value < 0)
+        return 0;
+    *size = (size_t) (value * unit);
+    return 1;
+}
+
+static int parseGCOptions(int argc, char** argv) {
+    int parsed = 0;
+    while (parsed < argc) {
+        if (strcmp(argv[parsed], "--gc-pause") == 0 && parsed + 1 < argc) {
+            char* end;
+            gcOptions.pauseBudget = strtol(argv[parsed + 1], &end, 10);
+            if (*end != '\0' || gcOptions.pauseBudget < 0) {
+                fprintf(stderr, "--gc-pause expects a number of microseconds, 0 to collect without pausing in slices\n");
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--gc-threads") == 0 && parsed + 1 < argc) {
+            gcOptions.markThreads = atoi(argv[parsed + 1]);
+            if (gcOptions.markThreads < 1 || gcOptions.markThreads > MAX_MARK_THREADS) {
+                fprintf(stderr, "--gc-threads expects a number of threads from 1 to %d\n", MAX_MARK_THREADS);
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--gc-initial") == 0 && parsed + 1 < argc) {
+            if (!parseSize(argv[parsed + 1], &gcOptions.initialHeap)) {
+                fprintf(stderr, "--gc-initial expects a heap size in bytes, K, M or G\n");
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--gc-growth") == 0 && parsed + 1 < argc) {
+            char* end;
+            gcOptions.growthFactor = strtod(argv[parsed + 1], &end);
+            if (*end != '\0' || !(gcOptions.growthFactor > 1)) {
+                fprintf(stderr, "--gc-growth expects a factor greater than 1\n");
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--gc-target") == 0 && parsed + 1 < argc) {
+            if (!parseSize(argv[parsed + 1], &gcOptions.targetHeap)) {
+                fprintf(stderr, "--gc-target expects a heap size in bytes, K, M or G, 0 for none\n");
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--heap-limit") == 0 && parsed + 1 < argc) {
+            if (!parseSize(argv[parsed + 1], &gcOptions.heapLimit)) {
+                fprintf(stderr, "--heap-limit expects a heap size in bytes, K, M or G, 0 for none\n");
+                exit(1);
+            }
+            parsed += 2;
+        } else if (strcmp(argv[parsed], "--heap-profile") == 0) {
+            gcOptions.allocationSites = 1;
+            parsed++;
+        } else if (strcmp(argv[parsed], "--gc-compact") == 0) {
+            gcOptions.compact = 1;
+            parsed++;
+        } else if (strcmp(argv[parsed], "--gc-stats") == 0) {
+            gcOptions.stats = 1;
+            parsed++;
+        } else if (strcmp(argv[parsed], "--hash-seed") == 0 && parsed + 1 < argc) {
+            // set before the first string is hashed, for every VM of the process
+            char* end;
+            if (strcmp(argv[parsed + 1], "random") == 0) {
+                if (getrandom(&hashSeed, sizeof(hashSeed), 0) != sizeof(hashSeed)) {
+                    fprintf(stderr, "--hash-seed: no random bytes available\n");
+                    exit(1);
+                }
+            } else {
+                hashSeed = strtoull(argv[parsed + 1], &end, 0);
+                if (*end != '\0' || end == argv[parsed + 1]) {
+                    fprintf(stderr, "--hash-seed expects a number, or random\n");
+                    exit(1);
+                }
+            }
+            parsed += 2;
+        } else {
+            break;
+        }
     }
+    return parsed;
 }
 
 int main(int argc, char **argv) {
-    if (argc <= 1) {
-        fprintf(stderr, "error: missing files names\n");
-        exit(1);
+    int skipped = 1 + parseGCOptions(argc - 1, argv + 1);
+    argc -= skipped - 1;
+    char* program = argv[0];
+    argv += skipped - 1;
+    if (argc > 1 && strcmp(argv[1], "--heap-diff") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "usage: %s --heap-diff before.heap after.heap\n", program);
+            exit(1);
+        }
+        return diffHeapSnapshots(argv[2], argv[3]) ? 0 : 1;
+    }
+    // SIGUSR1 asks for a heap snapshot, written when the script reaches a call or a loop
+    signal(SIGUSR1, requestHeapSnapshot);
+    if (argc > 1 && strcmp(argv[1], "--jobs") == 0) {
+        int jobs = argc > 2 ? atoi(argv[2]) : 0;
+        if (jobs <= 0 || argc <= 3) {
+            fprintf(stderr, "usage: %s [--gc-pause USEC] [--gc-threads N] [--gc-initial SIZE] [--gc-growth FACTOR] "
+                "[--gc-target SIZE] [--gc-compact] [--heap-limit SIZE] [--heap-profile] [--gc-stats] [--hash-seed N|random] "
+                "--jobs N file...\n", program);
+            exit(1);
+        }
+        int failures = runBatch(argv + 3, argc - 3, jobs);
+        freeChannels();
+        return failures == 0 ? 0 : 1;
     }
+
     Collector collector;
     initCollector(&collector);
+    applyGCOptions(&collector);
     VM vm;
+    initVM(&vm, &collector);
     Compiler compiler;
 
-    runFile(argv[1], &vm, &compiler, &collector);
+    int result = 1;
+    if (argc <= 1)
+        repl(&vm, &compiler, &collector);
+    else
+        result = runFile(argv[1], &vm, &compiler, &collector);
+    if (gcOptions.stats)
+        reportPauses(&collector, "gc");
+    if (!result) // compile or runtime error
+        exit(1);
+    freeVM(&vm);
+    freeChannels();
     return 0;
 }
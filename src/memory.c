@@ -1,115 +1,725 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "memory.h"
+#include "parallel_mark.h"
+#include "compact.h"
+#include "heap_snapshot.h"
 #include "./debug/debug_switches.h"
 
-static void collectGarbage(struct sCollector* collector) {
-#ifdef TRACE_GC
-    printf("START GC\n");
-    size_t oldAllocatedBytes = collector->allocatedBytes;
+static void appendObject(Obj*** objects, int* count, int* capacity, Obj* object) {
+    if (*capacity <= *count + 1) {
+        *capacity = compute_capacity(*capacity);
+        *objects = realloc(*objects, sizeof(Obj*) * (*capacity));
+    }
+    (*objects)[(*count)++] = object;
+}
+
+static void freeDead(struct sCollector* collector, Obj* object) {
+    // interned strings are weak
+    if (object->flags & OBJ_INTERNED)
+        stringSetRemove(&collector->interned, (ObjString*) object);
+    if (collector->sites != NULL)
+        forgetAllocation(collector, object);
+    if (!(object->flags & OBJ_LARGE))
+        slabClearObject(object);
+    size_t before = collector->allocatedBytes;
+    freeObject(collector, object);
+    collector->freedBytes += before - collector->allocatedBytes;
+}
+
+static int holdsSurvivor(SlabPage* page) {
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        for (uint64_t live = page->objects[i] & page->marks[i]; live != 0; live &= live - 1) {
+            Obj* object = (Obj*) ((char*) page + ((size_t) i * 64 + __builtin_ctzll(live)) * 8);
+            if (!(object->flags & OBJ_MOVED))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void promote(struct sCollector* collector, Obj* object, int minor) {
+    object->flags |= OBJ_OLD;
+    if (object->flags & OBJ_LARGE) {
+        object->marked = 0;
+        appendObject(&collector->large, &collector->largeCount, &collector->largeCapacity, object);
+    } else if (minor) {
+        slabUnmark(object);
+    }
+}
+
+// frees the unmarked young objects and promotes the others. Their marks are cleared after a
+// minor collection, after a major one the page sweeper clears them with those of old objects.
+// Nursery pages that kept survivors in place join the slabs, the others are emptied whole
+static void sweepYoung(struct sCollector* collector, int minor) {
+    SlabPage* next;
+    for (SlabPage* page = collector->slabs.nursery; page != NULL; page = next) {
+        next = page->next;
+        if (holdsSurvivor(page))
+            slabAdopt(&collector->slabs, page);
+        for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+            for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1) {
+                Obj* object = (Obj*) ((char*) page + ((size_t) i * 64 + __builtin_ctzll(objects)) * 8);
+                if (object->flags & OBJ_MOVED)
+                    continue;
+                if (!isMarked(object))
+                    freeDead(collector, object);
+                else
+                    promote(collector, object, minor);
+            }
+        }
+    }
+    slabResetNursery(&collector->slabs);
+    for (int i = 0; i < collector->youngCount; i++) {
+        Obj* object = collector->young[i];
+        if (!isMarked(object))
+            freeDead(collector, object);
+        else
+            promote(collector, object, minor);
+    }
+    collector->youngCount = 0;
+}
+
+// the few old objects outside the slabs are swept right after marking
+static void sweepLarge(struct sCollector* collector) {
+    int live = 0;
+    for (int i = 0; i < collector->largeCount; i++) {
+        Obj* object = collector->large[i];
+        if (!object->marked) {
+            freeDead(collector, object);
+        } else {
+            object->marked = 0;
+            collector->large[live++] = object;
+        }
+    }
+    collector->largeCount = live;
+}
+
+// frees the old objects of page left unmarked by the last major collection
+static void sweepPage(struct sCollector* collector, SlabPage* page) {
+    size_t before = collector->allocatedBytes;
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        uint64_t dead = page->objects[i] & ~page->marks[i];
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            freeDead(collector, (Obj*) ((char*) page + ((size_t) i * 64 + bit) * 8));
+        }
+        page->marks[i] = 0;
+    }
+    page->epoch = collector->slabs.epoch;
+    // keep the bytes allocated since the last collection right
+    collector->youngBaseBytes -= before - collector->allocatedBytes;
+}
+
+// collecting a heap whose objects mostly survived would free little, so it is given more room
+// to grow; a heap of mostly garbage is cheap to mark and is collected sooner
+static void paceNextCycle(struct sCollector* collector) {
+    size_t live = collector->allocatedBytes;
+    double survival = collector->cycleBaseBytes > live ? (double) live / collector->cycleBaseBytes : 1;
+    collector->survival = (collector->survival + survival) / 2;
+    collector->liveBytes = live;
+    double factor = 1 + (collector->growthFactor - 1) * (0.5 + collector->survival);
+    size_t threshold = (size_t) (live * factor);
+    if (collector->targetHeap > 0 && threshold > collector->targetHeap) {
+        // past the target, collect whenever the heap grows by an eighth
+        size_t least = live + live / 8;
+        threshold = collector->targetHeap > least ? collector->targetHeap : least;
+    }
+    if (threshold < collector->initialHeap)
+        threshold = collector->initialHeap;
+    collector->triggerGCThreshold = threshold;
+    if (collector->compact) {
+        Slabs* slabs = &collector->slabs;
+        size_t capacity = slabs->pageCount * SLAB_PAGE_BODY;
+#ifndef STRESS_GC
+        // compaction copies every object of the pages it empties: wait until half of the slabs are free
+        collector->compactPending = slabs->pageCount >= COMPACT_MIN_PAGES && capacity - slabs->used >= capacity / 2;
+#else
+        collector->compactPending = slabs->pageCount >= 2;
 #endif
+    }
+}
+
+static void sweepNextPage(struct sCollector* collector) {
+    SlabPage* page = collector->sweepCursor;
+    while (page != NULL && page->epoch == collector->slabs.epoch)
+        page = page->next;
+    if (page == NULL) {
+        collector->sweeping = 0;
+        collector->sweepCursor = NULL;
+        paceNextCycle(collector);
+        return;
+    }
+    collector->sweepCursor = page->next;
+    sweepPage(collector, page);
+}
 
+// collections start from a swept heap, where only the objects they mark carry a mark bit
+static void finishSweep(struct sCollector* collector) {
+    while (collector->sweeping)
+        sweepNextPage(collector);
+}
+
+static void forgetRemembered(struct sCollector* collector) {
+    for (int i = 0; i < collector->rememberedCount; i++)
+        collector->remembered[i]->flags &= ~OBJ_REMEMBERED;
+    collector->rememberedCount = 0;
+    collector->slotCount = 0;
+}
+
+void markRoots(struct sCollector* collector) {
     // mark stack
     for (Value* stackValue = collector->vm->stack; stackValue < collector->vm->sp; stackValue++) {
         markValue(collector, *stackValue);
     }
 
+    // mark the suspended stacks of the fibers that resumed the running one
+
+    for (Fiber* fiber = collector->vm->fiber->caller; fiber != NULL; fiber = fiber->caller) {
+        markFiber(collector, fiber);
+    }
+
     // mark globals
 
     markMap(collector, &collector->vm->globals);
 
-    // todo: mark frames (mark main script function)
+    // mark values held by the host
+
+    markValueArray(collector, &collector->vm->retained);
+
+    // mark spawned tasks
+
+    markEventLoop(collector, &collector->vm->loop);
+
+    // mark the one-character strings
+
+    for (int i = 0; i < 256; i++)
+        markObject(collector, (Obj*) collector->characters[i]);
     
     // mark open upvalues
 
     for (ObjUpvalue* upvalue = collector->vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
         markObject(collector, (Obj*) upvalue);
     }
+}
 
-    // blacken
-    
-    for (int i = 0; i < collector->worklistCount; i++) {
-        blackenObject(collector, collector->worklist[i]);
+static void drainWorklist(struct sCollector* collector, int minor) {
+    if (!minor && collector->markThreads > 1 && collector->allocatedBytes >= PARALLEL_MARK_BYTES) {
+        markInParallel(collector);
+        return;
     }
-    collector->worklistCount = 0;
+    while (collector->worklistCount > 0) {
+        blackenObject(collector, collector->worklist[--collector->worklistCount]);
+    }
+}
 
-    // remove unmarked interned
+static void finishCollection(struct sCollector* collector, int minor) {
+    forgetRemembered(collector);
 
-    removeUnmarkedKeys(collector, &collector->interned);
+    // sweep, promoting survivors: no young object is left for old ones to point to
 
-    // sweep
+    if (!minor)
+        sweepLarge(collector);
+    sweepYoung(collector, minor);
+    collector->minor = 0;
+    collector->nurseryFull = 0;
+    collector->youngBaseBytes = collector->allocatedBytes;
+    if (!minor) {
+        // old objects are swept page by page by the allocations that follow, the next
+        // major collection waits until the sweep has set its threshold
+        collector->slabs.epoch++;
+        collector->sweeping = 1;
+        collector->sweepCursor = collector->slabs.pages;
+        collector->triggerGCThreshold = SIZE_MAX;
+        collector->majorCollections++;
+    }
+    collector->collections++;
+}
 
-    Obj* previous = NULL;         
-    Obj* object = collector->objects;     
-    while (object != NULL) {
-        if (!object->marked) {
-            Obj* toFree = object;
-            if (previous == NULL) {
-                object = object->next;
-                collector->objects = object;
-            } else {
-                previous->next = object->next;
-                object = object->next;
-            }
-            freeObject(NULL, toFree);
-        } else {
-            object->marked = 0;
-            previous = object;
-            object = object->next;
+// a minor collection only traces and sweeps young objects: old ones are live by assumption, and
+// those written with young values since the last collection are remembered whole or by slot
+static void collectGarbage(struct sCollector* collector, int minor, int evacuate) {
+#ifdef TRACE_GC
+    printf("START %s GC\n", evacuate ? "COPYING MINOR" : minor ? "MINOR" : "MAJOR");
+    size_t oldAllocatedBytes = collector->allocatedBytes;
+#endif
+    finishSweep(collector);
+    collector->minor = minor;
+    if (!minor)
+        collector->cycleBaseBytes = collector->allocatedBytes;
+    markRoots(collector);
+
+    // mark young objects referenced by old ones
+
+    if (minor) {
+        for (int i = 0; i < collector->rememberedCount; i++)
+            blackenObject(collector, collector->remembered[i]);
+        for (int i = 0; i < collector->slotCount; i++) {
+            int count;
+            Value* values = slotValues(&collector->slots[i], &count);
+            for (int j = 0; values != NULL && j < count; j++)
+                markValue(collector, values[j]);
         }
     }
-
-    // update threshold
-    
-    collector->triggerGCThreshold = collector->allocatedBytes * GC_TRESHOLD_FACTOR;
+    drainWorklist(collector, minor);
+    if (evacuate)
+        evacuateNursery(collector);
+    finishCollection(collector, minor);
 #ifdef TRACE_GC
-    printf("freed bytes: %d\n", oldAllocatedBytes - collector->allocatedBytes);
+    printf("freed bytes: %ld\n", (long) (oldAllocatedBytes - collector->allocatedBytes));
     printf("END GC\n");
 #endif 
 }
 
-void* reallocate(Collector* collector, void* pointer, size_t oldsize, size_t newsize) {
-    if (collector != NULL) {
-        collector->allocatedBytes += newsize - oldsize;
-        if (collector->vm != NULL && oldsize < newsize) {
+static uint64_t nowNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+// blackens grey objects until the pause budget runs out, the cycle ends once none is left.
+// Objects allocated meanwhile stay white: they survive if the roots or a barrier reach them
+static void markSlice(struct sCollector* collector, uint64_t start) {
 #ifndef STRESS_GC
-            if (collector->allocatedBytes >= collector->triggerGCThreshold) {
-                collectGarbage(collector);
+    uint64_t deadline = start + (uint64_t) collector->pauseBudget * 1000u;
+    uint64_t lastCheck = start;
+    int work = 0;
+    while (collector->worklistCount > 0) {
+        blackenObject(collector, collector->worklist[--collector->worklistCount]);
+        // reading the clock costs more than blackening most objects: check every 64 of them,
+        // stopping when another batch as slow as the last one would overrun the budget
+        if (++work % 64 == 0) {
+            uint64_t now = nowNanos();
+            if (2 * now - lastCheck >= deadline)
+                return;
+            lastCheck = now;
+        }
+    }
+#else
+    // tiny slices, so that the mutator runs between most of the blackened objects
+    for (int work = 0; work < 4 && collector->worklistCount > 0; work++)
+        blackenObject(collector, collector->worklist[--collector->worklistCount]);
+    if (collector->worklistCount > 0)
+        return;
+#endif
+    // roots are written without barriers: rescan them and finish in one last pause
+    markRoots(collector);
+    drainWorklist(collector, 0);
+    collector->marking = 0;
+    finishCollection(collector, 0);
+}
+
+static void startCycle(struct sCollector* collector, uint64_t start) {
+#ifdef TRACE_GC
+    printf("START INCREMENTAL GC\n");
+#endif
+    finishSweep(collector);
+    collector->cycleBaseBytes = collector->allocatedBytes;
+    markRoots(collector);
+    collector->marking = 1;
+    collector->sliceBaseBytes = collector->allocatedBytes;
+    markSlice(collector, start);
+}
+
+static void recordPause(struct sCollector* collector, uint64_t start, int slice) {
+    uint64_t pause = nowNanos() - start;
+    PauseStats* stats = &collector->pauses;
+    stats->count++;
+    stats->totalNs += pause;
+    if (pause > stats->maxNs)
+        stats->maxNs = pause;
+    if (slice) {
+        stats->slices++;
+        if (pause > (uint64_t) collector->pauseBudget * 1000u)
+            stats->overBudget++;
+    }
+    int bucket = 0;
+    while (bucket < PAUSE_BUCKETS - 1 && pause > (1000u << bucket))
+        bucket++;
+    stats->buckets[bucket]++;
+}
+
+void reportPauses(struct sCollector* collector, const char* label) {
+    fprintf(stderr, "%s: %zu collections, %zu of them major, %zu copying the nursery, %.1f MB freed, heap %.1f MB, %.1f MB live after the last major one\n",
+        label, collector->collections, collector->majorCollections, collector->nurseryCopies, collector->freedBytes / 1e6,
+        collector->allocatedBytes / 1e6, collector->liveBytes / 1e6);
+    if (collector->compact)
+        fprintf(stderr, "%s: %zu compactions, %.1f MB of slab pages given back\n",
+            label, collector->compactions, collector->releasedBytes / 1e6);
+    PauseStats* stats = &collector->pauses;
+    fprintf(stderr, "%s: %zu pauses, total %.3f ms, max %.3f ms, %zu of %zu marking slices over the %ld us budget\n",
+        label, stats->count, stats->totalNs / 1e6, stats->maxNs / 1e6, stats->overBudget, stats->slices, collector->pauseBudget);
+    for (int i = 0; i < PAUSE_BUCKETS; i++) {
+        if (stats->buckets[i] == 0)
+            continue;
+        if (i < PAUSE_BUCKETS - 1)
+            fprintf(stderr, "%s:   <= %u us: %zu\n", label, 1u << i, stats->buckets[i]);
+        else
+            fprintf(stderr, "%s:    > %u us: %zu\n", label, 1u << (i - 1), stats->buckets[i]);
+    }
+}
+
+static const char* kindNames[OBJ_KINDS] = {
+    [OBJ_STRING] = "string", [OBJ_FUNCTION] = "function", [OBJ_NATIVE_FUNCTION] = "native",
+    [OBJ_CLOSURE] = "closure", [OBJ_UPVALUE] = "upvalue", [OBJ_ARRAY] = "array", [OBJ_DICT] = "dictionary",
+    [OBJ_ERROR] = "error", [OBJ_CHANNEL] = "channel", [OBJ_COROUTINE] = "coroutine",
+};
+
+const char* kindName(ObjType type) {
+    return kindNames[type];
+}
+
+static void countObject(Obj* object, size_t* counts, size_t* bytes) {
+    counts[object->type]++;
+    bytes[object->type] += objectSize(object);
+}
+
+// writes the three kinds of objects taking the most bytes, with their share of the heap
+void describeHeap(struct sCollector* collector, char* buffer, size_t size) {
+    size_t counts[OBJ_KINDS] = {0};
+    size_t bytes[OBJ_KINDS] = {0};
+    finishSweep(collector);
+    for (int nursery = 0; nursery < 2; nursery++) {
+        SlabPage* pages = nursery ? collector->slabs.nursery : collector->slabs.pages;
+        for (SlabPage* page = pages; page != NULL; page = page->next) {
+            for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+                for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1) {
+                    int bit = __builtin_ctzll(objects);
+                    countObject((Obj*) ((char*) page + ((size_t) i * 64 + bit) * 8), counts, bytes);
+                }
             }
+        }
+    }
+    for (int i = 0; i < collector->youngCount; i++)
+        countObject(collector->young[i], counts, bytes);
+    for (int i = 0; i < collector->largeCount; i++)
+        countObject(collector->large[i], counts, bytes);
+
+    int written = snprintf(buffer, size, "largest kinds:");
+    for (int rank = 0; rank < 3; rank++) {
+        size_t largest = 0;
+        for (size_t kind = 1; kind < OBJ_KINDS; kind++) {
+            if (bytes[kind] > bytes[largest])
+                largest = kind;
+        }
+        if (bytes[largest] == 0 || written < 0 || (size_t) written >= size)
+            break;
+        written += snprintf(buffer + written, size - written, "%s %s %.1f MB in %zu objects",
+            rank == 0 ? "" : ",", kindNames[largest], bytes[largest] / (1024.0 * 1024.0), counts[largest]);
+        bytes[largest] = 0;
+    }
+}
+
+void rememberObject(struct sCollector* collector, Obj* object) {
+    if (collector == NULL || (object->flags & OBJ_REMEMBERED))
+        return;
+    object->flags |= OBJ_REMEMBERED;
+    appendObject(&collector->remembered, &collector->rememberedCount, &collector->rememberedCapacity, object);
+}
+
+void addYoung(struct sCollector* collector, Obj* object) {
+    appendObject(&collector->young, &collector->youngCount, &collector->youngCapacity, object);
+}
+
+void writeBarrier(struct sCollector* collector, Obj* owner, Obj* value) {
+    if (collector == NULL)
+        return;
+    if ((owner->flags & OBJ_OLD) && !(value->flags & OBJ_OLD))
+        rememberObject(collector, owner);
+    if (collector->marking && isMarked(owner))
+        markObject(collector, value);
+}
+
+void slotBarrier(struct sCollector* collector, Obj* owner, int slot, Obj* value) {
+    if (collector == NULL)
+        return;
+    if ((owner->flags & OBJ_OLD) && !(value->flags & OBJ_OLD) && !(owner->flags & OBJ_REMEMBERED)) {
+        RememberedSlot* last = collector->slotCount > 0 ? &collector->slots[collector->slotCount - 1] : NULL;
+        if (last == NULL || last->owner != owner || last->slot != slot) {
+            if (collector->slotCapacity <= collector->slotCount) {
+                collector->slotCapacity = compute_capacity(collector->slotCapacity);
+                collector->slots = realloc(collector->slots, sizeof(RememberedSlot) * collector->slotCapacity);
+            }
+            collector->slots[collector->slotCount++] = (RememberedSlot) {.owner = owner, .slot = slot};
+            if (collector->slotCount >= (int) MAX_REMEMBERED_SLOTS)
+                collector->nurseryFull = 1;
+        }
+    }
+    if (collector->marking && isMarked(owner))
+        markObject(collector, value);
+}
+
+// an unmarked object found through a weak reference, like an interned string, while its
+// page waits to be swept: marking it keeps the sweeper from freeing it
+void reviveObject(struct sCollector* collector, Obj* object) {
+    if (collector->sweeping && !(object->flags & OBJ_LARGE) && !slab_page(object)->nursery
+        && slab_page(object)->epoch != collector->slabs.epoch)
+        slabMark(object);
+}
+
+// for objects whose many slots were written without barriers, like the stack of a coroutine
+void stackBarrier(struct sCollector* collector, Obj* owner) {
+    if (owner->flags & OBJ_OLD)
+        rememberObject(collector, owner);
+    rescanObject(collector, owner);
+}
+
+void collectAll(Collector* collector) {
+    uint64_t start = nowNanos();
+    if (collector->marking) {
+        markRoots(collector);
+        drainWorklist(collector, 0);
+        collector->marking = 0;
+        finishCollection(collector, 0);
+    } else {
+        collectGarbage(collector, 0, 0);
+    }
+    finishSweep(collector);
+    recordPause(collector, start, 0);
+}
+
+void collectNursery(Collector* collector, int evacuate) {
+    // a major cycle under way promotes every survivor anyway
+    if (collector->marking) {
+        collector->nurseryFull = 0;
+        return;
+    }
+    uint64_t start = nowNanos();
+    collectGarbage(collector, 1, evacuate);
+    if (evacuate)
+        collector->nurseryCopies++;
+    recordPause(collector, start, 0);
+}
+
+// the nursery is collected at the next safepoint, or right away if its pages doubled before one
+// was reached. The buffers of young arrays and dicts, which one instruction may grow a lot, wait
+static void collectYoung(Collector* collector) {
+    if ((size_t) collector->slabs.nurseryPages * SLAB_PAGE_SIZE < 2 * NURSERY_BYTES) {
+        collector->nurseryFull = 1;
+        return;
+    }
+    uint64_t start = nowNanos();
+    collectGarbage(collector, 1, 0);
+    recordPause(collector, start, 0);
+}
+
+// whether bytes more fit under the heap limit, after a full collection if they don't: when they
+// still don't, the VM raises an error before its next instruction
+int fitsHeapLimit(Collector* collector, size_t bytes) {
+    if (collector->heapLimit == 0 || collector->vm == NULL
+            || collector->allocatedBytes + bytes <= collector->heapLimit)
+        return 1;
+    if (!collector->overLimit)
+        collectAll(collector);
+    if (collector->allocatedBytes + bytes <= collector->heapLimit)
+        return 1;
+    if (!collector->overLimit) {
+        collector->overLimit = 1;
+        collector->overLimitLine = vmCurrentLine(collector->vm);
+    }
+    return 0;
+}
+
+// runs the collection work that allocatedBytes calls for, right before an allocation
+static void collectIfNeeded(Collector* collector) {
+    if (collector->heapLimit > 0 && collector->allocatedBytes > collector->heapLimit && !collector->overLimit) {
+        fitsHeapLimit(collector, 0);
+        return;
+    }
+#ifndef STRESS_GC
+    if (collector->marking) {
+        // minor collections wait for the cycle, which promotes every survivor anyway
+        if (collector->allocatedBytes - collector->sliceBaseBytes >= MARK_SLICE_BYTES) {
+            uint64_t start = nowNanos();
+            collector->sliceBaseBytes = collector->allocatedBytes;
+            markSlice(collector, start);
+            recordPause(collector, start, 1);
+        }
+    } else if (collector->allocatedBytes >= collector->triggerGCThreshold) {
+        uint64_t start = nowNanos();
+        if (collector->pauseBudget > 0) {
+            startCycle(collector, start);
+            recordPause(collector, start, 1);
+        } else {
+            collectGarbage(collector, 0, 0);
+            recordPause(collector, start, 0);
+        }
+    } else if ((size_t) collector->slabs.nurseryPages * SLAB_PAGE_SIZE >= NURSERY_BYTES
+            || collector->allocatedBytes - collector->youngBaseBytes >= YOUNG_BUFFER_BYTES) {
+        collectYoung(collector);
+    }
 #else
-            collectGarbage(collector);
+    // mostly minor collections, with an incremental major one now and then
+    uint64_t start = nowNanos();
+    if (collector->marking) {
+        markSlice(collector, start);
+    } else if (collector->collections % 8 == 7) {
+        if (collector->pauseBudget > 0)
+            startCycle(collector, start);
+        else
+            collectGarbage(collector, 0, 0);
+    } else if (collector->collections % 2 == 1) {
+        // every other minor one waits for the next safepoint, which copies the nursery if it can
+        collector->nurseryFull = 1;
+        return;
+    } else {
+        collectGarbage(collector, 1, 0);
+    }
+    recordPause(collector, start, collector->marking);
 #endif
+}
+
+static void outOfMemory(void) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+}
+
+void* reallocate(Collector* collector, void* pointer, size_t oldsize, size_t newsize) {
+    if (collector != NULL) {
+        collector->allocatedBytes += newsize - oldsize;
+        if (collector->vm != NULL && oldsize < newsize) {
+            if (collector->sweeping)
+                sweepNextPage(collector);
+            collectIfNeeded(collector);
         }
     }
     if (newsize == 0) {
         free(pointer);
         return NULL;
     }
-    return realloc(pointer, newsize);
+    void* result = realloc(pointer, newsize);
+    if (result == NULL)
+        outOfMemory();
+    return result;
+}
+
+void* allocateSmall(Collector* collector, size_t size) {
+    if (collector == NULL || size > SLAB_MAX_SIZE)
+        return reallocate(collector, NULL, 0, size);
+    collector->allocatedBytes += size;
+    if (collector->vm != NULL) {
+        // sweep until a block of this size is free, rather than carve a new one
+        while (collector->sweeping && !slabHasFree(&collector->slabs, size))
+            sweepNextPage(collector);
+        collectIfNeeded(collector);
+    }
+    void* block = slabAllocate(&collector->slabs, size);
+    if (block == NULL)
+        outOfMemory();
+    return block;
+}
+
+// objects are bumped from the nursery, a minor collection copies the live ones out or adopts their page
+void* allocateYoung(Collector* collector, size_t size) {
+    collector->allocatedBytes += size;
+    if (collector->vm != NULL) {
+        if (collector->sweeping)
+            sweepNextPage(collector);
+        collectIfNeeded(collector);
+    }
+    void* block = slabAllocateYoung(&collector->slabs, size);
+    if (block == NULL)
+        outOfMemory();
+    return block;
+}
+
+void freeSmall(Collector* collector, void* pointer, size_t size) {
+    if (collector == NULL || size > SLAB_MAX_SIZE) {
+        reallocate(collector, pointer, size, 0);
+        return;
+    }
+    collector->allocatedBytes -= size;
+    // the nursery is emptied a page at a time
+    if (!slab_page(pointer)->nursery)
+        slabFree(&collector->slabs, pointer, size);
 }
 
 void initCollector(Collector* collector) {
     collector->allocated = 0;
-    collector->objects = NULL;
+    collector->young = NULL;
+    collector->youngCount = 0;
+    collector->youngCapacity = 0;
+    collector->large = NULL;
+    collector->largeCount = 0;
+    collector->largeCapacity = 0;
+    collector->remembered = NULL;
+    collector->rememberedCount = 0;
+    collector->rememberedCapacity = 0;
+    collector->slots = NULL;
+    collector->slotCount = 0;
+    collector->slotCapacity = 0;
+    collector->minor = 0;
+    collector->nurseryFull = 0;
+    collector->youngBaseBytes = 0;
+    collector->collections = 0;
+    collector->majorCollections = 0;
+    collector->nurseryCopies = 0;
+    collector->freedBytes = 0;
+    collector->liveBytes = 0;
+    collector->cycleBaseBytes = 0;
+    collector->initialHeap = BASE_TRIGGER_GC_THRESHOLD;
+    collector->growthFactor = GC_TRESHOLD_FACTOR;
+    collector->targetHeap = 0;
+    collector->survival = 0.5;
+    collector->heapLimit = 0;
+    collector->overLimit = 0;
+    collector->overLimitLine = -1;
+    collector->marking = 0;
+    collector->sliceBaseBytes = 0;
+    collector->pauseBudget = DEFAULT_PAUSE_BUDGET_US;
+    collector->markThreads = defaultMarkThreads();
+    collector->parallel = 0;
+    collector->sweeping = 0;
+    collector->sweepCursor = NULL;
+    collector->pauses = (PauseStats) {0};
+    collector->sites = NULL;
+    collector->snapshotGeneration = __atomic_load_n(&heapSnapshotGeneration, __ATOMIC_RELAXED);
+    collector->snapshot = NULL;
+    collector->compact = 0;
+    collector->compactPending = 0;
+    collector->compactions = 0;
+    collector->releasedBytes = 0;
     collector->vm = NULL;
     collector->worklist = NULL;
     collector->worklistCount = 0;
     collector->worklistCapacity = 0;
     collector->allocatedBytes = 0;
     collector->triggerGCThreshold = BASE_TRIGGER_GC_THRESHOLD;
-    initMap(&collector->interned);
+    initSlabs(&collector->slabs);
+    initStringSet(&collector->interned);
+    for (int i = 0; i < 256; i++)
+        collector->characters[i] = NULL;
 }
 
 void freeCollector(Collector* collector) {
-    freeMap(NULL, &collector->interned);
-    while (collector->objects != NULL) {
-        Obj* next = collector->objects->next;
-        freeObject(NULL, collector->objects);
-        collector->objects = next;
+    // the blocks of the slabs are given back before the slabs themselves
+    freeStringSet(collector, &collector->interned);
+    for (int i = 0; i < collector->youngCount; i++)
+        freeObject(collector, collector->young[i]);
+    for (int i = 0; i < collector->largeCount; i++)
+        freeObject(collector, collector->large[i]);
+    for (int nursery = 0; nursery < 2; nursery++) {
+        SlabPage* pages = nursery ? collector->slabs.nursery : collector->slabs.pages;
+        for (SlabPage* page = pages; page != NULL; page = page->next) {
+            for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+                for (uint64_t objects = page->objects[i]; objects != 0; objects &= objects - 1) {
+                    int bit = __builtin_ctzll(objects);
+                    freeObject(collector, (Obj*) ((char*) page + ((size_t) i * 64 + bit) * 8));
+                }
+            }
+        }
     }
+    freeAllocationSites(collector);
+    free(collector->young);
+    free(collector->large);
     if (collector->worklist != NULL)
         free(collector->worklist);
+    free(collector->remembered);
+    free(collector->slots);
+    freeSlabs(&collector->slabs);
 }
 
 void pushSafe(struct sCollector* collector, Value value) {
@@ -2,25 +2,104 @@
 #define memory_h
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "./commontypes.h"
+#include "./slab.h"
 #include "./datastructs/value.h"
 #include "./datastructs/hash_map.h"
+#include "./datastructs/string_set.h"
 #include "vm.h"
+#include "heap_snapshot.h"
 
+// heap size that triggers the first major collection, and the least that triggers the others
 #define BASE_TRIGGER_GC_THRESHOLD (1024 * 1024)
 #define GC_TRESHOLD_FACTOR 2
+// bytes of nursery pages filled between minor collections, which copy the survivors out of the
+// nursery at the next safepoint of the VM. Past twice as many, the survivors are promoted in place
+#define NURSERY_BYTES (256 * 1024)
+// the buffers of young arrays and dicts are allocated outside of the nursery: they bring the next
+// minor collection forward only once they add up to this many bytes
+#define YOUNG_BUFFER_BYTES (4 * NURSERY_BYTES)
+// bytes allocated between two slices of incremental marking
+#define MARK_SLICE_BYTES (32 * 1024)
+#define DEFAULT_PAUSE_BUDGET_US 1000
+#define PAUSE_BUCKETS 16
+// slab pages below which compaction isn't worth it
+#define COMPACT_MIN_PAGES 16
+
+// a slot of an old array or dict written with a young value: the index of an element, or of an entry
+typedef struct {
+    Obj* owner;
+    int slot;
+} RememberedSlot;
+
+// slots remembered before the VM is asked for a minor collection, as they take memory without allocating
+#define MAX_REMEMBERED_SLOTS (NURSERY_BYTES / sizeof(RememberedSlot))
+
+typedef struct {
+    size_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    size_t slices; // pauses spent marking a major cycle incrementally
+    size_t overBudget;
+    size_t buckets[PAUSE_BUCKETS]; // pauses up to 2^i microseconds, the last one catches the rest
+} PauseStats;
 
 struct sCollector {
-    HashMap interned;
+    StringSet interned;
+    ObjString* characters[256]; // the interned one-character strings, rooted for good, see internCharacters
     VM* vm;
-    Obj* objects;
+    Obj** young; // large objects allocated since the last collection, the others are in the nursery
+    int youngCount;
+    int youngCapacity;
+    Obj** large; // old objects outside the slabs
+    int largeCount;
+    int largeCapacity;
+    Obj** remembered; // old objects with few fields written with young values, or without barriers
+    int rememberedCount;
+    int rememberedCapacity;
+    RememberedSlot* slots; // the other old objects write their young values here, one slot at a time
+    int slotCount;
+    int slotCapacity;
+    int minor; // the running collection traces young objects only
+    int nurseryFull; // the VM runs a copying minor collection at its next safepoint
+    size_t youngBaseBytes; // allocatedBytes after the last collection
+    size_t collections;
+    size_t majorCollections;
+    size_t nurseryCopies; // minor collections that copied the nursery
+    size_t freedBytes;
+    size_t liveBytes; // allocatedBytes once the last major collection was swept
+    size_t cycleBaseBytes; // allocatedBytes when the running major collection started
+    size_t initialHeap;
+    double growthFactor; // the heap may grow by this factor between major collections
+    size_t targetHeap; // the pacer keeps the heap under this size while the live data allows, 0 for none
+    double survival; // smoothed fraction of the heap surviving major collections
+    size_t heapLimit; // 0 for none
+    int overLimit; // a full collection left the heap over heapLimit, the VM is to raise an error
+    int overLimitLine; // of the allocation that crossed the limit, -1 outside of the script
+    int marking; // a major cycle is marking incrementally between allocations
+    size_t sliceBaseBytes; // allocatedBytes after the last marking slice
+    long pauseBudget; // microseconds a marking slice may take, 0 collects without slicing
+    int markThreads; // threads marking major collections of large heaps
+    int parallel; // set on the views of the collector used by mark workers
+    int sweeping; // the pages are swept lazily after a major collection
+    SlabPage* sweepCursor; // the next page to sweep
+    PauseStats pauses;
+    AllocSites* sites; // NULL unless allocation sites are tracked
+    HeapSnapshot* snapshot; // set on the view of the collector that walks the heap for a snapshot
+    unsigned snapshotGeneration; // the last heapSnapshotGeneration it wrote a snapshot for
+    int compact; // sparse slab pages are evacuated and given back to the system
+    int compactPending; // the last major collection left the slabs sparse, the VM compacts at its next safepoint
+    size_t compactions;
+    size_t releasedBytes;
     size_t allocated;
     Obj** worklist;
     int worklistCount;
     int worklistCapacity;
     size_t allocatedBytes;
     size_t triggerGCThreshold;
+    Slabs slabs;
 };
 
 #define compute_capacity(oldcap) \
@@ -38,13 +117,72 @@ struct sCollector {
 #define free_block(collector, type, block, ncells) \
     reallocate(collector, block, sizeof(type) * ncells, 0)
 
+// fixed size blocks: they come from the slabs of the collector, or from malloc without one
 #define allocate_pointer(collector, type, size) \
-    ((type*) reallocate(collector, NULL, 0, size))
+    ((type*) allocateSmall(collector, size))
 
 #define free_pointer(collector, pointer, size) \
-    reallocate(collector, pointer, size, 0) 
+    freeSmall(collector, pointer, size)
+
+// to be used after storing value into owner, once no allocation can happen in between:
+// remembers old owners of young values, and shades values stored into objects already
+// marked by an incremental cycle so that no black object points to a white one
+#define write_barrier(collector, owner, value) \
+    do { \
+        if (is_obj(value) && ((((Obj*) (owner))->flags & OBJ_OLD) || (collector)->marking)) \
+            writeBarrier(collector, (Obj*) (owner), as_obj(value)); \
+    } while (0)
+
+// the same for arrays and dicts, which may be too large to be traced and forwarded whole by
+// every minor collection: only the element or entry at slot is
+#define slot_barrier(collector, owner, slot, value) \
+    do { \
+        if (is_obj(value) && ((((Obj*) (owner))->flags & OBJ_OLD) || (collector)->marking)) \
+            slotBarrier(collector, (Obj*) (owner), slot, as_obj(value)); \
+    } while (0)
+
+// the values a remembered slot stands for, NULL once the array or the dict lost it
+static inline Value* slotValues(RememberedSlot* remembered, int* count) {
+    if (remembered->owner->type == OBJ_ARRAY) {
+        ValueArray* values = &((ObjArray*) remembered->owner)->values;
+        *count = 1;
+        return remembered->slot < values->count ? &values->values[remembered->slot] : NULL;
+    }
+    // an entry is its key followed by its value
+    HashMap* map = &((ObjDict*) remembered->owner)->map;
+    *count = 2;
+    return remembered->slot < map->count ? &map->entries[remembered->slot].key : NULL;
+}
+
+static inline int isMarked(Obj* object) {
+    if (object->flags & OBJ_LARGE)
+        return __atomic_load_n(&object->marked, __ATOMIC_RELAXED);
+    return slabMarked(object);
+}
 
 void* reallocate(struct sCollector* collector, void* pointer, size_t oldsize, size_t newsize); 
+void* allocateSmall(struct sCollector* collector, size_t size);
+void* allocateYoung(struct sCollector* collector, size_t size);
+void freeSmall(struct sCollector* collector, void* pointer, size_t size);
+void writeBarrier(struct sCollector* collector, Obj* owner, Obj* value);
+void slotBarrier(struct sCollector* collector, Obj* owner, int slot, Obj* value);
+void stackBarrier(struct sCollector* collector, Obj* owner);
+void rememberObject(struct sCollector* collector, Obj* object);
+void addYoung(struct sCollector* collector, Obj* object);
+void reviveObject(struct sCollector* collector, Obj* object);
+void reportPauses(struct sCollector* collector, const char* label);
+void describeHeap(struct sCollector* collector, char* buffer, size_t size);
+#define OBJ_KINDS (OBJ_COROUTINE + 1)
+const char* kindName(ObjType type);
+void markRoots(struct sCollector* collector);
+// runs a full collection and sweeps the whole heap
+void collectAll(struct sCollector* collector);
+// for allocations a script sizes in one step, checked before they are made
+int fitsHeapLimit(struct sCollector* collector, size_t bytes);
+// the minor collection the VM runs at a safepoint once the nursery is full. It copies the survivors
+// out of the nursery when evacuate is set: only the VM and the collector may then hold pointers
+// to young objects, see vmEvacuate
+void collectNursery(struct sCollector* collector, int evacuate);
 void initCollector(struct sCollector* collector); 
 void freeCollector(struct sCollector* collector); 
 #define pushSafeObj(collector, obj) pushSafe(collector, to_vobj(obj))
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "natives.h"
+#include "../datastructs/channel.h"
 
 Value nativeToStr(VM* vm, Value* args) {
     return to_vobj(valueToString(vm->collector, args[0]));
@@ -39,6 +40,10 @@ Value nativeTypeOfObject(VM* vm, Value* args) {
             return to_vobj(copyNoLengthString(vm->collector, "array"));
         case OBJ_DICT:
             return to_vobj(copyNoLengthString(vm->collector, "dictionary"));
+        case OBJ_CHANNEL:
+            return to_vobj(copyNoLengthString(vm->collector, "channel"));
+        case OBJ_COROUTINE:
+            return to_vobj(copyNoLengthString(vm->collector, "coroutine"));
         default:
             return to_vobj(newErrorFromCharArray(vm->collector, "value is not an object"));
     }
@@ -48,7 +53,7 @@ Value nativeSystem(VM* vm, Value* args) {
     Value arg = args[0];
     if (!is_string(arg))
         return to_vobj(newErrorFromCharArray(vm->collector, "passed non string to system"));
-    return to_vnumber(system(as_cstring(arg)));
+    return loopExec(vm, as_cstring(vm->collector, arg), 0);
 }
 
 Value nativeLen(VM* vm, Value* args) {
@@ -66,3 +71,115 @@ Value nativePairList(VM* vm, Value* args) {
     Obj* obj = as_obj(arg);
     return to_vobj(pairList(vm->collector, obj));
 }
+
+Value nativeChannel(VM* vm, Value* args) {
+    Value arg = args[0];
+    if (!is_string(arg))
+        return to_vobj(newErrorFromCharArray(vm->collector, "channel name must be a string"));
+    Channel* channel = openChannel(as_cstring(vm->collector, arg));
+    return to_vobj(newChannel(vm->collector, channel));
+}
+
+Value nativeSend(VM* vm, Value* args) {
+    if (!is_channel(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "can only send to channels"));
+    char* error;
+    if (!channelSend(vm->collector, as_channel(args[0])->channel, args[1], &error))
+        return to_vobj(newErrorFromCharArray(vm->collector, error));
+    return to_vbool(1);
+}
+
+Value nativeRecv(VM* vm, Value* args) {
+    if (!is_channel(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "can only receive from channels"));
+    Value result;
+    if (!channelReceive(vm->collector, as_channel(args[0])->channel, &result))
+        return to_vnihl(); // closed and drained
+    return result;
+}
+
+Value nativeClose(VM* vm, Value* args) {
+    if (!is_channel(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "can only close channels"));
+    channelClose(as_channel(args[0])->channel);
+    return to_vnihl();
+}
+
+Value nativeDone(VM* vm, Value* args) {
+    if (!is_coroutine(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "done expects a coroutine"));
+    return to_vbool(as_coroutine(args[0])->fiber.state == FIBER_DONE);
+}
+
+Value nativeSpawn(VM* vm, Value* args) {
+    return loopSpawn(vm, args[0]);
+}
+
+Value nativeRun(VM* vm, Value* args) {
+    (void) args;
+    if (vm->loop.current != NULL)
+        return to_vobj(newErrorFromCharArray(vm->collector, "run cannot be called from a task"));
+    // the runtime error of the failed task has been raised already, and unwinds the caller too
+    if (!loopRun(vm))
+        return to_vobj(newErrorFromCharArray(vm->collector, "a task failed"));
+    return to_vnihl();
+}
+
+Value nativeSleep(VM* vm, Value* args) {
+    if (!is_number(args[0]) || as_cnumber(args[0]) < 0)
+        return to_vobj(newErrorFromCharArray(vm->collector, "sleep expects a non negative number of seconds"));
+    return loopSleep(vm, as_cnumber(args[0]));
+}
+
+Value nativeExec(VM* vm, Value* args) {
+    if (!is_string(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "passed non string to exec"));
+    return loopExec(vm, as_cstring(vm->collector, args[0]), 1);
+}
+
+Value nativeReadFile(VM* vm, Value* args) {
+    if (!is_string(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "file path must be a string"));
+    return loopReadFile(vm, as_cstring(vm->collector, args[0]));
+}
+
+Value nativeTry(VM* vm, Value* args) {
+    if (!isCallable(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "try expects a function without parameters"));
+    return vmTry(vm, args[0]);
+}
+
+static void putStat(VM* vm, ObjDict* stats, char* name, double number) {
+    Value key = to_vobj(copyNoLengthString(vm->collector, name));
+    Value value = to_vnumber(number);
+    pushSafe(vm->collector, key);
+    indexSetDict(vm->collector, stats, &key, &value);
+    popSafe(vm->collector);
+}
+
+Value nativeGCStats(VM* vm, Value* args) {
+    (void) args;
+    Collector* collector = vm->collector;
+    ObjDict* stats = newDict(collector);
+    pushSafeObj(collector, stats);
+    putStat(vm, stats, "collections", collector->collections);
+    putStat(vm, stats, "major", collector->majorCollections);
+    putStat(vm, stats, "freed", collector->freedBytes);
+    putStat(vm, stats, "heap", collector->allocatedBytes);
+    putStat(vm, stats, "live", collector->liveBytes);
+    putStat(vm, stats, "pauses", collector->pauses.count);
+    putStat(vm, stats, "pausetime", collector->pauses.totalNs / 1e6);
+    putStat(vm, stats, "maxpause", collector->pauses.maxNs / 1e6);
+    putStat(vm, stats, "compactions", collector->compactions);
+    putStat(vm, stats, "released", collector->releasedBytes);
+    popSafe(collector);
+    return to_vobj(stats);
+}
+
+Value nativeHeapDump(VM* vm, Value* args) {
+    if (!is_string(args[0]))
+        return to_vobj(newErrorFromCharArray(vm->collector, "heap snapshot path must be a string"));
+    if (!writeHeapSnapshot(vm->collector, as_cstring(vm->collector, args[0])))
+        return to_vobj(newErrorFromCharArray(vm->collector, "cannot write heap snapshot"));
+    return to_vnihl();
+}
@@ -9,6 +9,19 @@ Value nativeTypeOfObject(VM* vm, Value* args);
 Value nativeSystem(VM* vm, Value* args);
 Value nativeLen(VM* vm, Value* args);
 Value nativePairList(VM* vm, Value* args);
+Value nativeChannel(VM* vm, Value* args);
+Value nativeSend(VM* vm, Value* args);
+Value nativeRecv(VM* vm, Value* args);
+Value nativeClose(VM* vm, Value* args);
+Value nativeDone(VM* vm, Value* args);
+Value nativeSpawn(VM* vm, Value* args);
+Value nativeRun(VM* vm, Value* args);
+Value nativeSleep(VM* vm, Value* args);
+Value nativeExec(VM* vm, Value* args);
+Value nativeReadFile(VM* vm, Value* args);
+Value nativeGCStats(VM* vm, Value* args);
+Value nativeTry(VM* vm, Value* args);
+Value nativeHeapDump(VM* vm, Value* args);
 
 #define natives_h_declare(vm) \
     vmDeclareNative(vm, 1, "tostr", &nativeToStr); \
@@ -17,5 +30,18 @@ Value nativePairList(VM* vm, Value* args);
     vmDeclareNative(vm, 1, "system", &nativeSystem); \
     vmDeclareNative(vm, 1, "len", &nativeLen); \
     vmDeclareNative(vm, 1, "pairList", &nativePairList); \
+    vmDeclareNative(vm, 1, "channel", &nativeChannel); \
+    vmDeclareNative(vm, 2, "send", &nativeSend); \
+    vmDeclareNative(vm, 1, "recv", &nativeRecv); \
+    vmDeclareNative(vm, 1, "close", &nativeClose); \
+    vmDeclareNative(vm, 1, "done", &nativeDone); \
+    vmDeclareNative(vm, 1, "spawn", &nativeSpawn); \
+    vmDeclareNative(vm, 0, "run", &nativeRun); \
+    vmDeclareNative(vm, 1, "sleep", &nativeSleep); \
+    vmDeclareNative(vm, 1, "exec", &nativeExec); \
+    vmDeclareNative(vm, 1, "readfile", &nativeReadFile); \
+    vmDeclareNative(vm, 0, "gcstats", &nativeGCStats); \
+    vmDeclareNative(vm, 1, "try", &nativeTry); \
+    vmDeclareNative(vm, 1, "heapdump", &nativeHeapDump); \
 
 #endif
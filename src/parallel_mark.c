@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "parallel_mark.h"
+#include "memory.h"
+
+typedef struct sMarkGroup MarkGroup;
+
+// a mark worker blackens through its own view of the collector, whose worklist is private to the
+// worker; part of it is moved to the shared stack when other workers run out of objects to steal
+typedef struct {
+    Collector view;
+    MarkGroup* group;
+    pthread_mutex_t lock;
+    Obj** shared;
+    int sharedCount;
+    int sharedCapacity;
+} Marker;
+
+struct sMarkGroup {
+    Marker* markers;
+    int count;
+    int idle; // workers that found no objects to blacken, updated atomically
+};
+
+int defaultMarkThreads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        return 1;
+    return cores < MAX_MARK_THREADS ? (int) cores : MAX_MARK_THREADS;
+}
+
+static void pushAll(Obj*** stack, int* count, int* capacity, Obj** objects, int n) {
+    if (*capacity < *count + n) {
+        while (*capacity < *count + n)
+            *capacity = compute_capacity(*capacity);
+        *stack = realloc(*stack, sizeof(Obj*) * (*capacity));
+    }
+    memcpy(*stack + *count, objects, sizeof(Obj*) * n);
+    *count += n;
+}
+
+// moves the bottom half of the private worklist to the shared stack, where idle workers find it
+static void share(Marker* marker) {
+    Collector* view = &marker->view;
+    int half = view->worklistCount / 2;
+    pthread_mutex_lock(&marker->lock);
+    // the count is read without the lock by workers looking for objects
+    int sharedCount = marker->sharedCount;
+    pushAll(&marker->shared, &sharedCount, &marker->sharedCapacity, view->worklist, half);
+    __atomic_store_n(&marker->sharedCount, sharedCount, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&marker->lock);
+    memmove(view->worklist, view->worklist + half, sizeof(Obj*) * (view->worklistCount - half));
+    view->worklistCount -= half;
+}
+
+// takes half of the shared stack of victim, all of it when the victim is the marker itself
+static int take(Marker* marker, Marker* victim) {
+    if (__atomic_load_n(&victim->sharedCount, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+    pthread_mutex_lock(&victim->lock);
+    int n = victim == marker ? victim->sharedCount : (victim->sharedCount + 1) / 2;
+    Collector* view = &marker->view;
+    if (n > 0) {
+        int sharedCount = victim->sharedCount - n;
+        pushAll(&view->worklist, &view->worklistCount, &view->worklistCapacity, victim->shared + sharedCount, n);
+        __atomic_store_n(&victim->sharedCount, sharedCount, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&victim->lock);
+    return n > 0;
+}
+
+static int steal(Marker* marker) {
+    MarkGroup* group = marker->group;
+    int self = (int) (marker - group->markers);
+    for (int i = 1; i < group->count; i++) {
+        if (take(marker, &group->markers[(self + i) % group->count]))
+            return 1;
+    }
+    return 0;
+}
+
+static int anyShared(MarkGroup* group) {
+    for (int i = 0; i < group->count; i++) {
+        if (__atomic_load_n(&group->markers[i].sharedCount, __ATOMIC_ACQUIRE) > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void* markWorker(void* arg) {
+    Marker* marker = (Marker*) arg;
+    MarkGroup* group = marker->group;
+    Collector* view = &marker->view;
+    for (;;) {
+        while (view->worklistCount > 0) {
+            blackenObject(view, view->worklist[--view->worklistCount]);
+            if (view->worklistCount > 1 && __atomic_load_n(&group->idle, __ATOMIC_RELAXED) > 0
+                    && __atomic_load_n(&marker->sharedCount, __ATOMIC_ACQUIRE) == 0)
+                share(marker);
+        }
+        if (take(marker, marker) || steal(marker))
+            continue;
+        // both stacks of an idle worker are empty and only it fills them: once every worker
+        // is idle, no grey object is left
+        __atomic_add_fetch(&group->idle, 1, __ATOMIC_ACQ_REL);
+        for (;;) {
+            if (__atomic_load_n(&group->idle, __ATOMIC_ACQUIRE) == group->count)
+                return NULL;
+            if (anyShared(group)) {
+                __atomic_sub_fetch(&group->idle, 1, __ATOMIC_ACQ_REL);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+void markInParallel(Collector* collector) {
+    int count = collector->markThreads;
+    MarkGroup group = {.count = count, .idle = 0};
+    group.markers = (Marker*) calloc(count, sizeof(Marker));
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * count);
+    if (group.markers == NULL || threads == NULL) {
+        free(group.markers);
+        free(threads);
+        while (collector->worklistCount > 0)
+            blackenObject(collector, collector->worklist[--collector->worklistCount]);
+        return;
+    }
+
+    // deal the grey objects out to the workers
+    for (int i = 0; i < count; i++) {
+        Marker* marker = &group.markers[i];
+        marker->view = *collector;
+        marker->view.parallel = 1;
+        marker->view.worklist = NULL;
+        marker->view.worklistCount = 0;
+        marker->view.worklistCapacity = 0;
+        marker->group = &group;
+        pthread_mutex_init(&marker->lock, NULL);
+    }
+    for (int i = 0; i < collector->worklistCount; i++) {
+        Collector* view = &group.markers[i % count].view;
+        pushAll(&view->worklist, &view->worklistCount, &view->worklistCapacity, &collector->worklist[i], 1);
+    }
+    collector->worklistCount = 0;
+
+    // the calling thread is worker 0; the objects of workers that fail to start go to it
+    int started[MAX_MARK_THREADS] = {0};
+    for (int i = 1; i < count; i++)
+        started[i] = pthread_create(&threads[i], NULL, markWorker, &group.markers[i]) == 0;
+    for (int i = 1; i < count; i++) {
+        if (started[i])
+            continue;
+        Collector* view = &group.markers[i].view;
+        Collector* first = &group.markers[0].view;
+        pushAll(&first->worklist, &first->worklistCount, &first->worklistCapacity, view->worklist, view->worklistCount);
+        view->worklistCount = 0;
+        __atomic_add_fetch(&group.idle, 1, __ATOMIC_ACQ_REL);
+    }
+    markWorker(&group.markers[0]);
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && started[i])
+            pthread_join(threads[i], NULL);
+        free(group.markers[i].view.worklist);
+        free(group.markers[i].shared);
+        pthread_mutex_destroy(&group.markers[i].lock);
+    }
+    free(group.markers);
+    free(threads);
+}
@@ -0,0 +1,14 @@
+#ifndef parallel_mark_h
+#define parallel_mark_h
+
+#include "./commontypes.h"
+
+#define MAX_MARK_THREADS 8
+// heaps smaller than this are marked faster than threads start
+#define PARALLEL_MARK_BYTES (8 * 1024 * 1024)
+
+int defaultMarkThreads(void);
+// blackens everything reachable from the grey objects of the collector worklist on collector->markThreads threads
+void markInParallel(Collector* collector);
+
+#endif
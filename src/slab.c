@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+// address sanitizer builds fence off free blocks, which it cannot tell apart from used ones
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define poison(block, size) ASAN_POISON_MEMORY_REGION(block, size)
+#define unpoison(block, size) ASAN_UNPOISON_MEMORY_REGION(block, size)
+#else
+#define poison(block, size) ((void) 0)
+#define unpoison(block, size) ((void) 0)
+#endif
+
+#define size_class(size) (((size) + 7) / 8 - 1)
+#define class_size(class) (((size_t) (class) + 1) * 8)
+// released pages keep their first system page, which holds the header
+#define RELEASE_OFFSET 4096
+
+void initSlabs(Slabs* slabs) {
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        slabs->free[i] = NULL;
+    slabs->bump = NULL;
+    slabs->end = NULL;
+    slabs->pages = NULL;
+    slabs->pageCount = 0;
+    slabs->used = 0;
+    slabs->released = NULL;
+    slabs->epoch = 0;
+    slabs->youngBump = NULL;
+    slabs->youngEnd = NULL;
+    slabs->nursery = NULL;
+    slabs->nurseryPages = 0;
+    slabs->spare = NULL;
+}
+
+static void freePages(SlabPage* page) {
+    while (page != NULL) {
+        SlabPage* next = page->next;
+        unpoison(page, SLAB_PAGE_SIZE);
+        free(page);
+        page = next;
+    }
+}
+
+void freeSlabs(Slabs* slabs) {
+    freePages(slabs->pages);
+    freePages(slabs->released);
+    freePages(slabs->nursery);
+    freePages(slabs->spare);
+    initSlabs(slabs);
+}
+
+static void pushFree(Slabs* slabs, void* block, int class) {
+    *(void**) block = slabs->free[class];
+    slabs->free[class] = block;
+    poison(block, class_size(class));
+}
+
+static SlabPage* newPage(Slabs* slabs) {
+    SlabPage* page = slabs->released;
+    if (page != NULL)
+        slabs->released = page->next;
+    else
+        page = (SlabPage*) aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL)
+        return NULL;
+    unpoison(page, sizeof(SlabPage));
+    page->epoch = slabs->epoch; // nothing to sweep yet
+    page->evacuating = 0;
+    page->nursery = 0;
+    page->pinned = 0;
+    memset(page->marks, 0, sizeof(page->marks));
+    memset(page->objects, 0, sizeof(page->objects));
+    poison(page + 1, SLAB_PAGE_BODY);
+    return page;
+}
+
+// hands the unused end of a page to the free lists, in blocks of the largest classes
+static void freeTail(Slabs* slabs, char* tail, char* end) {
+    while (tail < end) {
+        size_t size = end - tail < SLAB_MAX_SIZE ? (size_t) (end - tail) : SLAB_MAX_SIZE;
+        unpoison(tail, sizeof(void*));
+        pushFree(slabs, tail, size_class(size));
+        tail += size;
+    }
+}
+
+void* slabAllocate(Slabs* slabs, size_t size) {
+    int class = size_class(size);
+    size_t blockSize = class_size(class);
+    void* block = slabs->free[class];
+    if (block != NULL) {
+        unpoison(block, blockSize);
+        slabs->free[class] = *(void**) block;
+        slabs->used += blockSize;
+        return block;
+    }
+    if (slabs->bump == NULL || (size_t) (slabs->end - slabs->bump) < blockSize) {
+        // the tail of the previous page is too small for this class and goes to a smaller one
+        if (slabs->bump != NULL)
+            freeTail(slabs, slabs->bump, slabs->end);
+        SlabPage* page = newPage(slabs);
+        if (page == NULL)
+            return NULL;
+        page->next = slabs->pages;
+        slabs->pages = page;
+        slabs->pageCount++;
+        slabs->bump = (char*) (page + 1);
+        slabs->end = (char*) page + SLAB_PAGE_SIZE;
+    }
+    block = slabs->bump;
+    slabs->bump += blockSize;
+    slabs->used += blockSize;
+    unpoison(block, blockSize);
+    return block;
+}
+
+void* slabAllocateYoung(Slabs* slabs, size_t size) {
+    size_t blockSize = slabBlockSize(size);
+    if (slabs->youngBump == NULL || (size_t) (slabs->youngEnd - slabs->youngBump) < blockSize) {
+        if (slabs->youngBump != NULL)
+            slab_page(slabs->youngEnd - 1)->top = slabs->youngBump;
+        SlabPage* page = slabs->spare;
+        if (page != NULL)
+            slabs->spare = page->next;
+        else if ((page = newPage(slabs)) == NULL)
+            return NULL;
+        page->nursery = 1;
+        page->next = slabs->nursery;
+        slabs->nursery = page;
+        slabs->nurseryPages++;
+        slabs->youngBump = (char*) (page + 1);
+        slabs->youngEnd = (char*) page + SLAB_PAGE_SIZE;
+    }
+    void* block = slabs->youngBump;
+    slabs->youngBump += blockSize;
+    unpoison(block, blockSize);
+    return block;
+}
+
+void slabAdopt(Slabs* slabs, SlabPage* page) {
+    char* end = (char*) page + SLAB_PAGE_SIZE;
+    char* top = page->top;
+    if (slabs->youngBump != NULL && slabs->youngEnd == end) {
+        top = slabs->youngBump;
+        slabs->youngBump = slabs->youngEnd = NULL;
+    }
+    for (SlabPage** link = &slabs->nursery; *link != NULL; link = &(*link)->next) {
+        if (*link == page) {
+            *link = page->next;
+            break;
+        }
+    }
+    page->nursery = 0;
+    page->pinned = 0;
+    slabs->nurseryPages--;
+    page->next = slabs->pages;
+    slabs->pages = page;
+    slabs->pageCount++;
+    // its dead objects are freed one by one by the collection adopting it
+    slabs->used += top - (char*) (page + 1);
+    if (slabs->bump != NULL && end - top <= slabs->end - slabs->bump) {
+        freeTail(slabs, top, end);
+        return;
+    }
+    // a tail larger than what is left to bump is bumped next
+    if (slabs->bump != NULL)
+        freeTail(slabs, slabs->bump, slabs->end);
+    slabs->bump = top;
+    slabs->end = end;
+}
+
+void slabResetNursery(Slabs* slabs) {
+    while (slabs->nursery != NULL) {
+        SlabPage* page = slabs->nursery;
+        slabs->nursery = page->next;
+        page->pinned = 0;
+        memset(page->marks, 0, sizeof(page->marks));
+        memset(page->objects, 0, sizeof(page->objects));
+        poison(page + 1, SLAB_PAGE_BODY);
+        page->next = slabs->spare;
+        slabs->spare = page;
+    }
+    slabs->nurseryPages = 0;
+    slabs->youngBump = slabs->youngEnd = NULL;
+}
+
+void slabFree(Slabs* slabs, void* block, size_t size) {
+    int class = size_class(size);
+    slabs->used -= class_size(class);
+    pushFree(slabs, block, class);
+}
+
+int slabHasFree(Slabs* slabs, size_t size) {
+    return slabs->free[size_class(size)] != NULL;
+}
+
+size_t slabBlockSize(size_t size) {
+    return class_size(size_class(size));
+}
+
+SlabPage* slabBumpPage(Slabs* slabs) {
+    return slabs->bump == NULL ? NULL : slab_page(slabs->end - 1);
+}
+
+void slabCountFree(Slabs* slabs) {
+    for (SlabPage* page = slabs->pages; page != NULL; page = page->next)
+        page->freeBytes = 0;
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        for (void* block = slabs->free[class]; block != NULL;) {
+            slab_page(block)->freeBytes += class_size(class);
+            unpoison(block, sizeof(void*));
+            void* next = *(void**) block;
+            poison(block, sizeof(void*));
+            block = next;
+        }
+    }
+}
+
+void slabDropEvacuating(Slabs* slabs) {
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        void* kept = NULL;
+        for (void* block = slabs->free[class]; block != NULL;) {
+            unpoison(block, sizeof(void*));
+            void* next = *(void**) block;
+            if (!slab_page(block)->evacuating) {
+                *(void**) block = kept;
+                kept = block;
+            }
+            poison(block, sizeof(void*));
+            block = next;
+        }
+        slabs->free[class] = kept;
+    }
+}
+
+size_t slabRelease(Slabs* slabs, SlabPage* page) {
+    for (SlabPage** link = &slabs->pages; *link != NULL; link = &(*link)->next) {
+        if (*link == page) {
+            *link = page->next;
+            break;
+        }
+    }
+    slabs->pageCount--;
+    unpoison(page, SLAB_PAGE_SIZE);
+    madvise((char*) page + RELEASE_OFFSET, SLAB_PAGE_SIZE - RELEASE_OFFSET, MADV_DONTNEED);
+    poison((char*) page + RELEASE_OFFSET, SLAB_PAGE_SIZE - RELEASE_OFFSET);
+    page->next = slabs->released;
+    slabs->released = page;
+    return SLAB_PAGE_SIZE - RELEASE_OFFSET;
+}
@@ -0,0 +1,105 @@
+#ifndef slab_h
+#define slab_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// blocks up to SLAB_MAX_SIZE bytes come from pages owned by a collector, rounded up to
+// a multiple of 8: freed blocks are kept on the free list of their size class
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 8)
+#define SLAB_PAGE_SIZE (64 * 1024)
+// one bit for every 8 bytes of a page
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / 8 / 64)
+
+typedef struct sSlabPage SlabPage;
+
+// pages are aligned on their size, so the page of a block, and its bits, follow from its address.
+// Mark bits live here rather than in the objects: clearing them doesn't touch the objects
+struct sSlabPage {
+    SlabPage* next;
+    unsigned epoch; // the page is left to sweep while it is older than Slabs.epoch
+    // filled in by compaction, which empties the sparse pages
+    unsigned freeBytes;
+    unsigned foreignBytes; // blocks other than objects, moved by their owners
+    int evacuating;
+    int nursery; // new objects are bumped from it, see slabAllocateYoung
+    int pinned; // a nursery page some survivors of the running minor collection stay in
+    char* top; // past the last block bumped into a nursery page
+    uint64_t marks[SLAB_BITMAP_WORDS];
+    uint64_t objects[SLAB_BITMAP_WORDS]; // first blocks of the objects, which sweeping walks
+};
+
+// bytes of a page past its header: but for the part still to bump, each belongs to a block or to a free list
+#define SLAB_PAGE_BODY (SLAB_PAGE_SIZE - sizeof(SlabPage))
+
+typedef struct {
+    void* free[SLAB_CLASSES];
+    // every class is carved from the same page, so blocks allocated together stay together
+    char* bump;
+    char* end;
+    SlabPage* pages;
+    int pageCount;
+    size_t used; // bytes of the blocks handed out
+    SlabPage* released; // pages given back to the system, reused before new ones
+    unsigned epoch;
+    // the nursery: its pages stay off the list of the others until a collection adopts them
+    char* youngBump;
+    char* youngEnd;
+    SlabPage* nursery;
+    int nurseryPages;
+    SlabPage* spare; // emptied nursery pages
+} Slabs;
+
+#define slab_page(block) ((SlabPage*) ((uintptr_t) (block) & ~((uintptr_t) SLAB_PAGE_SIZE - 1)))
+#define slab_bit(block) (((uintptr_t) (block) & (SLAB_PAGE_SIZE - 1)) / 8)
+#define slab_word(bitmap, block) (&slab_page(block)->bitmap[slab_bit(block) / 64])
+#define slab_mask(block) ((uint64_t) 1 << (slab_bit(block) % 64))
+
+static inline int slabMarked(void* block) {
+    return (__atomic_load_n(slab_word(marks, block), __ATOMIC_RELAXED) & slab_mask(block)) != 0;
+}
+
+static inline void slabMark(void* block) {
+    *slab_word(marks, block) |= slab_mask(block);
+}
+
+// returns whether this call set the bit, when several threads may be marking the same page
+static inline int slabMarkAtomic(void* block) {
+    uint64_t mask = slab_mask(block);
+    return (__atomic_fetch_or(slab_word(marks, block), mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+static inline void slabUnmark(void* block) {
+    *slab_word(marks, block) &= ~slab_mask(block);
+}
+
+static inline void slabSetObject(void* block) {
+    *slab_word(objects, block) |= slab_mask(block);
+}
+
+static inline void slabClearObject(void* block) {
+    *slab_word(objects, block) &= ~slab_mask(block);
+}
+
+void initSlabs(Slabs* slabs);
+void freeSlabs(Slabs* slabs);
+void* slabAllocate(Slabs* slabs, size_t size);
+void slabFree(Slabs* slabs, void* block, size_t size);
+int slabHasFree(Slabs* slabs, size_t size);
+size_t slabBlockSize(size_t size);
+// the page blocks are bumped from, NULL before the first one
+SlabPage* slabBumpPage(Slabs* slabs);
+void slabCountFree(Slabs* slabs);
+// takes the free blocks of evacuating pages off the free lists
+void slabDropEvacuating(Slabs* slabs);
+// bumps a block of the nursery, where objects are freed only by emptying their whole page
+void* slabAllocateYoung(Slabs* slabs, size_t size);
+// makes a nursery page an ordinary one, handing its unused part to the free lists or the bump
+void slabAdopt(Slabs* slabs, SlabPage* page);
+// empties the nursery pages that were not adopted, for the next young objects
+void slabResetNursery(Slabs* slabs);
+// unlinks an empty page and gives its memory back to the system, returns how many bytes
+size_t slabRelease(Slabs* slabs, SlabPage* page);
+
+#endif
@@ -26,23 +26,94 @@ static inline uint32_t hash_int(uint32_t a) {
     return a;
 }
 
+// the seed of string hashes, 0 unless --hash-seed sets it before any VM starts: a random one keeps
+// untrusted keys from being picked to collide
+extern uint64_t hashSeed;
+
+// wyhash (final version 4), which reads strings 8 bytes at a time and mixes them with 64 to 128
+// bit multiplications
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t wy_read8(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wy_read4(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
 static inline uint32_t hash_string(char* key, int length) {
-    uint32_t hash = 2166136261u;
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+    };
+    const uint8_t* p = (const uint8_t*) key;
+    size_t left = length;
+    uint64_t seed = hashSeed ^ wy_mix(hashSeed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (left <= 16) {
+        if (left >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((left >> 3) << 2));
+            b = (wy_read4(p + left - 4) << 32) | wy_read4(p + left - 4 - ((left >> 3) << 2));
+        } else if (left > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[left >> 1] << 8) | p[left - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (left > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ secret[2], wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ secret[3], wy_read8(p + 40) ^ see2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (left > 16) {
+            seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = wy_read8(p + left - 16);
+        b = wy_read8(p + left - 8);
+    }
+    __uint128_t product = (__uint128_t) (a ^ secret[1]) * (b ^ seed);
+    a = (uint64_t) product;
+    b = (uint64_t) (product >> 64);
+    return (uint32_t) wy_mix(a ^ secret[0] ^ (uint64_t) length, b ^ secret[1]);
+}
 
-    for (int i = 0; i < length; i++) {                     
-        hash ^= key[i];                                      
-        hash *= 16777619;                                    
-    }                                                      
+// the finalizer of MurmurHash3: every bit of the input reaches the low 32 bits of the result
+static inline uint32_t hash_int64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return (uint32_t) k;
+}
 
-    return hash;                                           
-}     
 #define hash_pointer(p) hash_int((uintptr_t) (p))
-#define hash_double(v) hash_int(float_to_bits((float) v))
 
-static inline uint32_t float_to_bits(float v) {
-    uint32_t i = 0;
-    memcpy(&i, &v, sizeof(float));
-    return i;
+// equal numbers hash alike: integral ones, the usual keys, by their integer, which takes -0 as 0,
+// the others by all of their bits, with a single NaN
+static inline uint32_t hash_double(double v) {
+    if (v >= -9223372036854775808.0 && v < 9223372036854775808.0 && v == (double) (int64_t) v)
+        return hash_int64((uint64_t) (int64_t) v);
+    uint64_t bits = 0x7ff8000000000000ull;
+    if (v == v)
+        memcpy(&bits, &v, sizeof(double));
+    return hash_int64(bits);
 }
 
 static inline int is_integer(double n) {
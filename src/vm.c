@@ -5,6 +5,7 @@
 
 #include "vm.h"
 #include "memory.h"
+#include "compact.h"
 #include "util.h"
 #include "./datastructs/value.h"
 #include "./compilation_pipeline/compiler.h"
@@ -15,16 +16,80 @@
 #define RUNTIME_ERROR 0
 #define RUNTIME_OK 1
 
+static void saveFiber(struct sVM* vm) {
+    Fiber* fiber = vm->fiber;
+    fiber->frames = vm->frames;
+    fiber->fp = vm->fp;
+    fiber->frameCapacity = vm->frameCapacity;
+    fiber->stack = vm->stack;
+    fiber->sp = vm->sp;
+    fiber->stackCapacity = vm->stackCapacity;
+    fiber->openUpvalues = vm->openUpvalues;
+}
+
+static void loadFiber(struct sVM* vm, Fiber* fiber) {
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->fp = fiber->fp;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->sp = fiber->sp;
+    vm->stackCapacity = fiber->stackCapacity;
+    vm->openUpvalues = fiber->openUpvalues;
+}
+
+// moves objects only from the outermost run, between tasks or instructions: natives and hosts
+// deeper in the C stack may hold pointers to objects in their locals
+int vmMayMove(struct sVM* vm) {
+    return vm->runDepth == 0 && vm->tryDepth == 0 && vm->loop.current == NULL;
+}
+
+void vmCompact(struct sVM* vm) {
+    if (!vmMayMove(vm))
+        return;
+    saveFiber(vm);
+    compactHeap(vm->collector);
+    loadFiber(vm, vm->fiber);
+}
+
+void vmEvacuate(struct sVM* vm) {
+    if (!vmMayMove(vm)) {
+        collectNursery(vm->collector, 0);
+        return;
+    }
+    saveFiber(vm);
+    collectNursery(vm->collector, 1);
+    loadFiber(vm, vm->fiber);
+}
+
 static void resetStack(struct sVM* vm) {
+    loadFiber(vm, &vm->mainFiber);
     vm->sp = vm->stack;
+    vm->fp = 0;
+    vm->openUpvalues = NULL;
 }
 
-void initVM(struct sVM* vm) {
-    vm->fp = 0;
+void initVM(struct sVM* vm, Collector* collector) {
+    Fiber* main = &vm->mainFiber;
+    main->frames = vm->mainFrames;
+    main->frameCapacity = MAX_FRAMES;
+    main->stack = vm->mainStack;
+    main->stackCapacity = MAX_STACK;
+    main->caller = NULL;
+    main->owner = NULL;
+    main->state = FIBER_RUNNING;
     resetStack(vm);
     initMap(&vm->globals);
-    vm->openUpvalues = NULL;
-    vm->collector = NULL;
+    initValueArray(&vm->retained);
+    initEventLoop(&vm->loop);
+    vm->runDepth = 0;
+    vm->tryDepth = 0;
+    vm->hadError = 0;
+    vm->collector = collector;
+    collector->vm = vm;
+
+    internCharacters(collector);
+    declareNatives(vm);
 }
 
 void vmDeclareNative(struct sVM* vm, int arity, char* name, CNativeFunction cfunction) {
@@ -44,23 +109,97 @@ Value vmPop(struct sVM* vm) {
     return *vm->sp;
 }
 
-static void runtimeError(struct sVM* vm, char* format, ...) {
-    int instruction = vm->frames[vm->fp - 1].pc - vm->frames[vm->fp - 1].closure->function->bytecode->code - 1; 
-    int line = lineArrayGet(&vm->frames[vm->fp - 1].closure->function->bytecode->lines, instruction);         
+static void closeUpvalueList(struct sVM* vm, ObjUpvalue* upvalue) {
+    while (upvalue != NULL) {
+        closeUpvalue(vm->collector, upvalue);
+        upvalue = upvalue->next;
+    }
+}
 
-    va_list args;                                    
-    va_start(args, format);                          
-    fprintf(stderr, "runtime error [line %d] in program: ", line);  
+static void closeAllUpvalues(struct sVM* vm) {
+    saveFiber(vm);
+    // the whole chain of resumed coroutines stays rooted until every upvalue is closed
+    for (Fiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller) {
+        closeUpvalueList(vm, fiber->openUpvalues);
+        fiber->openUpvalues = NULL;
+    }
+    vm->openUpvalues = NULL;
+    // coroutines caught in the error can't be resumed anymore
+    for (Fiber* fiber = vm->fiber; fiber->owner != NULL; ) {
+        Fiber* caller = fiber->caller;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        freeFiberStacks(vm->collector, fiber);
+        fiber = caller;
+    }
+}
+
+int vmCurrentLine(struct sVM* vm) {
+    if (vm->fp == 0)
+        return -1;
+    CallFrame* frame = &vm->frames[vm->fp - 1];
+    int instruction = frame->pc - frame->closure->function->bytecode->code - 1;
+    return lineArrayGet(&frame->closure->function->bytecode->lines, instruction);
+}
+
+static void vRuntimeError(struct sVM* vm, int line, char* format, va_list args) {
+    if (vm->tryDepth > 0) {
+        // vmTry unwinds the stack and turns the message into an error value
+        int written = line >= 0 ? snprintf(vm->errorMessage, sizeof(vm->errorMessage), "[line %d] ", line) : 0;
+        vsnprintf(vm->errorMessage + written, sizeof(vm->errorMessage) - written, format, args);
+        vm->hadError = 1;
+        return;
+    }
+    if (line >= 0) {
+        fprintf(stderr, "runtime error [line %d] in program: ", line);  
+    } else {
+        fprintf(stderr, "runtime error in program: ");  
+    }
     vfprintf(stderr, format, args);                  
-    va_end(args);                                    
     fputs("\n", stderr);
+    // the stack is about to be discarded: closures that captured its slots must keep their values
+    closeAllUpvalues(vm);
     resetStack(vm);                                    
+    resetEventLoop(&vm->loop);
+    vm->hadError = 1;
 }    
 
+static void runtimeError(struct sVM* vm, char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vRuntimeError(vm, vmCurrentLine(vm), format, args);
+    va_end(args);
+}
+
+static void runtimeErrorAt(struct sVM* vm, int line, char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vRuntimeError(vm, line, format, args);
+    va_end(args);
+}
+
+// reported at the line of the allocation that crossed the limit
+static void heapLimitError(struct sVM* vm) {
+    Collector* collector = vm->collector;
+    char kinds[160];
+    describeHeap(collector, kinds, sizeof(kinds));
+    collector->overLimit = 0;
+    runtimeErrorAt(vm, collector->overLimitLine, "heap limit of %.1f MB exceeded, %s",
+        collector->heapLimit / (1024.0 * 1024.0), kinds);
+}
+
 static Value vmPeek(struct sVM* vm, int depth) {
     return vm->sp[-(depth + 1)];
 }
 
+// comparing strings reads their characters: ropes are flattened while they are still on the stack
+static void flattenOperands(struct sVM* vm) {
+    for (int i = 0; i < 2; i++) {
+        if (is_string(vmPeek(vm, i)))
+            flattenString(vm->collector, as_string(vmPeek(vm, i)));
+    }
+}
+
 static void closeOnStackUpvalue(struct sVM* vm, Value* value) {
     // todo: this can be optimized
     ObjUpvalue* prev = NULL;
@@ -69,14 +208,14 @@ static void closeOnStackUpvalue(struct sVM* vm, Value* value) {
         return;
     if (current->value == value) {
         vm->openUpvalues = current->next;
-        closeUpvalue(current);
+        closeUpvalue(vm->collector, current);
     } else {
         prev = current;
         current = current->next;
         while (current != NULL) {
             if (current->value == value) {
                 prev->next = current->next;
-                closeUpvalue(current);
+                closeUpvalue(vm->collector, current);
                 break;
             }
             prev = prev->next;
@@ -85,6 +224,80 @@ static void closeOnStackUpvalue(struct sVM* vm, Value* value) {
     }
 }
 
+// doubles the frames and the stack of a coroutine, moving every pointer into the old stack
+static void growFiber(struct sVM* vm) {
+    Value* oldStack = vm->stack;
+    int frameCapacity = vm->frameCapacity * 2;
+    int stackCapacity = vm->stackCapacity * 2;
+    vm->frames = grow_array(vm->collector, CallFrame, vm->frames, vm->frameCapacity, frameCapacity);
+    vm->frameCapacity = frameCapacity;
+    vm->stack = grow_array(vm->collector, Value, vm->stack, vm->stackCapacity, stackCapacity);
+    vm->stackCapacity = stackCapacity;
+    if (vm->stack == oldStack)
+        return;
+    for (int i = 0; i < vm->fp; i++)
+        vm->frames[i].localStack = vm->stack + (vm->frames[i].localStack - oldStack);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalue->value = vm->stack + (upvalue->value - oldStack);
+    vm->sp = vm->stack + (vm->sp - oldStack);
+}
+
+// makes room for one more frame and its locals
+static int reserveFrame(struct sVM* vm) {
+    while (vm->fp + 1 >= vm->frameCapacity || vm->sp + UINT8_MAX + 1 > vm->stack + vm->stackCapacity) {
+        if (vm->fiber->owner == NULL || vm->frameCapacity >= MAX_FRAMES) {
+            runtimeError(vm, "stack overflow");
+            return 0;
+        }
+        growFiber(vm);
+    }
+    return 1;
+}
+
+// moves the callee and its arguments to a new coroutine, which replaces them on the stack
+static void spawnCoroutine(struct sVM* vm, ObjClosure* closure, int argCount) {
+    Value* callee = vm->sp - argCount - 1;
+    ObjCoroutine* coroutine = newCoroutine(vm->collector, closure, callee, argCount + 1);
+    vm->sp = callee;
+    vmPush(vm, to_vobj(coroutine));
+}
+
+// the resumed coroutine leaves its next value in place of itself on the caller's stack
+static int resumeCoroutine(struct sVM* vm, ObjCoroutine* coroutine, int argCount) {
+    Fiber* fiber = &coroutine->fiber;
+    if (argCount != 0) {
+        runtimeError(vm, "expected 0 arguments, got %d", argCount);
+        return 0;
+    }
+    if (fiber->state == FIBER_RUNNING) {
+        runtimeError(vm, "coroutine is already running");
+        return 0;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtimeError(vm, "coroutine is done");
+        return 0;
+    }
+    saveFiber(vm);
+    fiber->caller = vm->fiber;
+    fiber->state = FIBER_RUNNING;
+    loadFiber(vm, fiber);
+    return 1;
+}
+
+// switches back to the caller of the running coroutine, handing it value
+static void leaveCoroutine(struct sVM* vm, Value value, FiberState state) {
+    Fiber* fiber = vm->fiber;
+    saveFiber(vm);
+    fiber->state = state;
+    loadFiber(vm, fiber->caller);
+    fiber->caller = NULL;
+    vm->sp[-1] = value;
+    if (state == FIBER_DONE)
+        freeFiberStacks(vm->collector, fiber);
+    else // its stack was written while running
+        stackBarrier(vm->collector, (Obj*) fiber->owner);
+}
+
 static int callObject(struct sVM* vm, Obj* called, int argCount) {
     switch (called->type) {
         case OBJ_CLOSURE:
@@ -95,10 +308,12 @@ static int callObject(struct sVM* vm, Obj* called, int argCount) {
                     runtimeError(vm, "expected %d arguments, got %d", function->arity, argCount);
                     return 0;
                 }
-                if (vm->fp + 1 >= MAX_FRAMES) {             
-                    runtimeError(vm, "stack overflow");             
-                    return 0;                                
-                } 
+                if (function->isGenerator) {
+                    spawnCoroutine(vm, closure, argCount);
+                    return 1;
+                }
+                if (!reserveFrame(vm))
+                    return 0;
                 CallFrame* currentFrame = &vm->frames[vm->fp++];
                 currentFrame->closure = closure;
                 currentFrame->pc = currentFrame->closure->function->bytecode->code;
@@ -113,16 +328,28 @@ static int callObject(struct sVM* vm, Obj* called, int argCount) {
                     return 0;
                 }
                 Value result = native->cfunction(vm, vm->sp - argCount);
+                // natives calling back into the VM may have failed and reset the stack
+                if (vm->hadError)
+                    return 0;
+                if (vm->collector->overLimit) {
+                    heapLimitError(vm);
+                    return 0;
+                }
                 vm->sp = vm->sp - argCount - 1; // -1 to pop off native
                 vmPush(vm, result);
+                // the native started I/O for a task: hand control back to the scheduler
+                if (vm->loop.parked)
+                    leaveCoroutine(vm, to_vnihl(), FIBER_SUSPENDED);
                 return 1;
             }
+        case OBJ_COROUTINE:
+            return resumeCoroutine(vm, (ObjCoroutine*) called, argCount);
     }
 }
 
-static int vmRun(struct sVM* vm) {
-    vm->fp = 1;
-    CallFrame* currentFrame = &vm->frames[0];
+// runs until baseFiber is back to baseFp frames, leaving the last result on the stack
+static int vmRun(struct sVM* vm, Fiber* baseFiber, int baseFp) {
+    CallFrame* currentFrame = &vm->frames[vm->fp - 1];
     OpCode caseCode;
 #define read_byte() (*(currentFrame->pc++))
 #define read_long() join_bytes(read_byte(), read_byte())
@@ -141,6 +368,24 @@ static int vmRun(struct sVM* vm) {
         vmPush(vm, destination(a operator b)); \
     } while (0)
 
+// calls and backward jumps bound how long a script runs without reaching either: the heap limit,
+// snapshot requests, the nursery and compaction are checked there rather than on every instruction.
+// Of the instructions in between, only ++ and natives allocate as much as a script asks for: they
+// check the heap limit themselves
+#define safepoint() \
+    do { \
+        if (vm->collector->overLimit) { \
+            heapLimitError(vm); \
+            return RUNTIME_ERROR; \
+        } \
+        if (__atomic_load_n(&heapSnapshotGeneration, __ATOMIC_RELAXED) != vm->collector->snapshotGeneration) \
+            writeRequestedSnapshot(vm->collector); \
+        if (vm->collector->nurseryFull) \
+            vmEvacuate(vm); \
+        if (vm->collector->compactPending) \
+            vmCompact(vm); \
+    } while (0)
+
 #ifdef TRACE_EXEC
     printf("VM EXECUTION TRACE:\n");
 #endif
@@ -168,23 +413,38 @@ static int vmRun(struct sVM* vm) {
         switch ((caseCode = read_byte())) {
             case OP_RET: 
                 {
-                    Value retVal = vmPop(vm);
+                    Value retVal = vmPeek(vm, 0);
                     vm->fp--;
-                    if (vm->fp == 0)
-                        return RUNTIME_OK;
-                    // close local variables still on the stack
-                    while (vm->sp > currentFrame->localStack) { 
+                    // close local variables still on the stack, keeping the return value rooted on top
+                    for (Value* local = vm->sp - 2; local >= currentFrame->localStack; local--) {
                         // todo this can be done more efficiently
-                        closeOnStackUpvalue(vm, vm->sp - 1);
-                        vm->sp--;
+                        closeOnStackUpvalue(vm, local);
                     }
-                    vmPop(vm); // pop returning function
-                    currentFrame = &vm->frames[vm->fp - 1];
+                    vm->sp = currentFrame->localStack - 1; // pop locals and returning function
                     vmPush(vm, retVal);
+                    if (vm->fp == 0 && vm->fiber->owner != NULL)
+                        leaveCoroutine(vm, retVal, FIBER_DONE);
+                    if (vm->fp == baseFp && vm->fiber == baseFiber)
+                        return RUNTIME_OK;
+                    currentFrame = &vm->frames[vm->fp - 1];
+                    break;
+                }
+            case OP_YIELD:
+                {
+                    if (vm->fiber->owner == NULL) {
+                        runtimeError(vm, "cannot yield outside of a coroutine");
+                        return RUNTIME_ERROR;
+                    }
+                    Value yielded = vmPop(vm);
+                    leaveCoroutine(vm, yielded, FIBER_SUSPENDED);
+                    if (vm->fp == baseFp && vm->fiber == baseFiber)
+                        return RUNTIME_OK;
+                    currentFrame = &vm->frames[vm->fp - 1];
                     break;
                 }
             case OP_CALL:
                 {
+                    safepoint();
                     uint8_t argCount = read_byte();
                     if (argCount > (vm->sp - vm->stack)) {
                         runtimeError(vm, "too many function arguments");
@@ -198,6 +458,8 @@ static int vmRun(struct sVM* vm) {
                     if (!callObject(vm, as_obj(called), argCount)) {
                         return RUNTIME_ERROR;
                     }
+                    if (vm->fp == baseFp && vm->fiber == baseFiber)
+                        return RUNTIME_OK;
                     currentFrame = &vm->frames[vm->fp - 1];
                     break;
                 }
@@ -254,12 +516,15 @@ static int vmRun(struct sVM* vm) {
                             if (current == NULL) {
                                 closure->upvalues[i] = 
                                     newUpvalue(vm->collector, currentFrame->localStack + index);
+                                closure->upvalues[i]->stackOwner = vm->fiber->owner;
                                 closure->upvalues[i]->next = vm->openUpvalues;
                                 vm->openUpvalues = closure->upvalues[i];
                             } else {
                                 closure->upvalues[i] = current;
                             }
                         }
+                        // allocating the upvalues may have promoted the closure
+                        write_barrier(vm->collector, closure, to_vobj(closure->upvalues[i]));
                     }
                     break;
                 }
@@ -274,7 +539,9 @@ static int vmRun(struct sVM* vm) {
             case OP_UPVALUE_SET_LONG:
                 {
                     uint16_t index = read_long_if(OP_UPVALUE_SET_LONG);
-                    *currentFrame->closure->upvalues[index]->value = vmPeek(vm, 0);
+                    ObjUpvalue* upvalue = currentFrame->closure->upvalues[index];
+                    *upvalue->value = vmPeek(vm, 0);
+                    write_barrier(vm->collector, upvalue, *upvalue->value);
                     break;
                 }
             case OP_ARRAY:
@@ -397,6 +664,7 @@ static int vmRun(struct sVM* vm) {
                     uint8_t* oldpc = currentFrame->pc - 1;
                     uint16_t argument = read_long();
                     currentFrame->pc = oldpc - argument;
+                    safepoint();
                     break;
                 }
             case OP_XOR:
@@ -516,6 +784,7 @@ static int vmRun(struct sVM* vm) {
                 }
             case OP_EQUAL:
                 {
+                    flattenOperands(vm);
                     Value b = vmPop(vm);
                     Value a = vmPop(vm);
                     vmPush(vm, to_vbool(valuesEqual(a, b)));
@@ -523,6 +792,7 @@ static int vmRun(struct sVM* vm) {
                 }
             case OP_NOT_EQUAL:
                 {
+                    flattenOperands(vm);
                     Value b = vmPop(vm);
                     Value a = vmPop(vm);
                     vmPush(vm, to_vbool(!valuesEqual(a, b)));
@@ -553,6 +823,10 @@ static int vmRun(struct sVM* vm) {
                     Value b = vmPeek(vm, 0);
                     Value a = vmPeek(vm, 1);
                     Value result = concatenate(vm->collector, a, b);
+                    if (vm->collector->overLimit) {
+                        heapLimitError(vm);
+                        return RUNTIME_ERROR;
+                    }
                     if (is_error(result)) {
                         runtimeError(vm, as_error(result)->message->chars);
                         return RUNTIME_ERROR;
@@ -578,6 +852,7 @@ static int vmRun(struct sVM* vm) {
                 }
         }
     }
+#undef safepoint
 #undef read_byte
 #undef read_constant
 #undef read_constant_long
@@ -585,28 +860,120 @@ static int vmRun(struct sVM* vm) {
 #undef read_constant_long_if
 }
 
-int vmExecute(struct sVM* vm, Collector* collector, ObjFunction* function) {
-    initVM(vm);
-    CallFrame* initialFrame = &vm->frames[0];
-    initialFrame->closure = newClosure(collector, function);
+int vmExecute(struct sVM* vm, ObjFunction* function) {
+    resetStack(vm);
+    vm->hadError = 0;
+    // the script closure lives in stack slot 0, so it stays rooted while it runs
+    vmPush(vm, to_vobj(function));
+    ObjClosure* closure = newClosure(vm->collector, function);
+    vm->sp[-1] = to_vobj(closure);
+
+    CallFrame* initialFrame = &vm->frames[vm->fp++];
+    initialFrame->closure = closure;
     initialFrame->pc = function->bytecode->code;
-    initialFrame->localStack = vm->stack;
-    mapPut(NULL, &vm->globals, to_vobj(initialFrame->closure), to_vnihl());
+    initialFrame->localStack = vm->sp;
 
-    vm->collector = collector;
-    collector->vm = vm;
+    int result = vmRun(vm, vm->fiber, 0);
+    resetStack(vm);
+    return result;
+}
 
-    declareNatives(vm);
+static int runCall(struct sVM* vm, Value callee, int argCount, Value* args, Value* result) {
+    if (!isCallable(callee)) {
+        runtimeError(vm, "value is not callable");
+        return RUNTIME_ERROR;
+    }
+    // the host may pass more arguments than the stack has room left for
+    while (vm->sp + argCount + 1 > vm->stack + vm->stackCapacity) {
+        if (vm->fiber->owner == NULL || vm->frameCapacity >= MAX_FRAMES) {
+            runtimeError(vm, "stack overflow");
+            return RUNTIME_ERROR;
+        }
+        growFiber(vm);
+    }
+    Fiber* baseFiber = vm->fiber;
+    int baseFp = vm->fp;
+    vmPush(vm, callee);
+    for (int i = 0; i < argCount; i++)
+        vmPush(vm, args[i]);
+    if (!callObject(vm, as_obj(callee), argCount))
+        return RUNTIME_ERROR;
+    // natives complete inside callObject, closures and coroutines need the interpreter loop
+    if ((vm->fp != baseFp || vm->fiber != baseFiber) && !vmRun(vm, baseFiber, baseFp))
+        return RUNTIME_ERROR;
+    *result = vmPop(vm);
+    return RUNTIME_OK;
+}
 
-    int result = vmRun(vm);
-    freeVM(vm);
-    return result;
+int vmCall(struct sVM* vm, Value callee, int argCount, Value* args, Value* result) {
+    if (vm->runDepth == 0)
+        vm->hadError = 0;
+    vm->runDepth++;
+    int status = runCall(vm, callee, argCount, args, result);
+    vm->runDepth--;
+    return status;
+}
+
+Value vmTry(struct sVM* vm, Value callee) {
+    Fiber* baseFiber = vm->fiber;
+    int baseFp = vm->fp;
+    ptrdiff_t baseSp = vm->sp - vm->stack;
+    Value result;
+    vm->tryDepth++;
+    int status = runCall(vm, callee, 0, NULL, &result);
+    vm->tryDepth--;
+    if (status == RUNTIME_OK)
+        return result;
+
+    // coroutines resumed since the call can't be resumed anymore
+    saveFiber(vm);
+    for (Fiber* fiber = vm->fiber; fiber != baseFiber && fiber->owner != NULL; ) {
+        Fiber* caller = fiber->caller;
+        closeUpvalueList(vm, fiber->openUpvalues);
+        fiber->openUpvalues = NULL;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        freeFiberStacks(vm->collector, fiber);
+        fiber = caller;
+    }
+    loadFiber(vm, baseFiber);
+    baseFiber->state = FIBER_RUNNING;
+    for (Value* slot = vm->sp - 1; slot >= vm->stack + baseSp; slot--)
+        closeOnStackUpvalue(vm, slot);
+    vm->sp = vm->stack + baseSp;
+    vm->fp = baseFp;
+    vm->hadError = 0;
+    return to_vobj(newErrorFromCharArray(vm->collector, vm->errorMessage));
+}
+
+void vmRetain(struct sVM* vm, Value value) {
+    pushSafe(vm->collector, value);
+    writeValueArray(vm->collector, &vm->retained, value);
+    popSafe(vm->collector);
+}
+
+void vmRelease(struct sVM* vm, Value value) {
+    ValueArray* retained = &vm->retained;
+    // equal strings are compared by their characters, which ropes have once flattened
+    if (is_string(value)) {
+        pushSafe(vm->collector, value);
+        flattenString(vm->collector, as_string(value));
+        popSafe(vm->collector);
+    }
+    for (int i = retained->count - 1; i >= 0; i--) {
+        if (is_string(retained->values[i]))
+            flattenString(vm->collector, as_string(retained->values[i]));
+        if (valuesEqual(retained->values[i], value)) {
+            retained->values[i] = retained->values[--retained->count];
+            return;
+        }
+    }
 }
 
 void freeVM(struct sVM* vm) {
 #ifdef TRACE_INTERNED
     printf("INTERNED:\n");
-    printMap(&vm->collector->interned);
+    printStringSet(&vm->collector->interned);
     printf("\n");
 #endif
 #ifdef TRACE_GLOBALS
@@ -614,6 +981,8 @@ void freeVM(struct sVM* vm) {
     printMap(&vm->globals);
     printf("\n");
 #endif
+    freeMap(vm->collector, &vm->globals);
     freeCollector(vm->collector);
-    freeMap(NULL, &vm->globals);
+    freeValueArray(NULL, &vm->retained);
+    freeEventLoop(&vm->loop);
 }
@@ -5,28 +5,54 @@
 #include "./commontypes.h"
 #include "./datastructs/value.h"
 #include "./datastructs/hash_map.h"
+#include "./event_loop.h"
 
 #define MAX_FRAMES 256                       
 #define MAX_STACK (MAX_FRAMES * UINT8_MAX)
+// coroutine stacks start small and double up to MAX_FRAMES frames
+#define COROUTINE_FRAMES 8
+#define COROUTINE_STACK (2 * (UINT8_MAX + 1))
 
-typedef struct {
-    ObjClosure* closure;
-    uint8_t* pc;
-    Value* localStack;
-} CallFrame;
-
+// a VM and its collector own all of their state: independent pairs can run on different threads
 struct sVM {
-    CallFrame frames[MAX_FRAMES];
+    // registers of the running fiber, saved into it when switching
+    CallFrame* frames;
     int fp;
-    Value stack[MAX_STACK];
+    int frameCapacity;
+    Value* stack;
     Value* sp;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    Fiber* fiber;
+
+    Fiber mainFiber;
+    CallFrame mainFrames[MAX_FRAMES];
+    Value mainStack[MAX_STACK];
     Collector* collector;
     HashMap globals;
-    ObjUpvalue* openUpvalues;
+    ValueArray retained; // values held by the host, see vmRetain
+    EventLoop loop;
+    int runDepth; // nesting of vmCall
+    int hadError; // a runtime error is unwinding through natives
+    int tryDepth; // nesting of vmTry, whose innermost call catches runtime errors
+    char errorMessage[256]; // of the error being caught
 };
 
-void initVM(struct sVM* vm);
-int vmExecute(struct sVM* vm, Collector* collector, ObjFunction* function);  
+void initVM(struct sVM* vm, Collector* collector);
+int vmExecute(struct sVM* vm, ObjFunction* function);  
+int vmCall(struct sVM* vm, Value callee, int argCount, Value* args, Value* result);
+// calls callee without arguments: a runtime error inside it unwinds back here and is returned as an error
+Value vmTry(struct sVM* vm, Value callee);
+int vmCurrentLine(struct sVM* vm);
+// whether objects may move: no native or host is in the middle of a call
+int vmMayMove(struct sVM* vm);
+// runs a compaction of the heap unless a native or the host is in the middle of a call
+void vmCompact(struct sVM* vm);
+// runs the minor collection the full nursery waits for, which copies its survivors out under the
+// same condition and promotes them in place otherwise
+void vmEvacuate(struct sVM* vm);
+void vmRetain(struct sVM* vm, Value value);
+void vmRelease(struct sVM* vm, Value value);
 void vmDeclareNative(struct sVM* vm, int arity, char* name, CNativeFunction cfunction);
 void freeVM(struct sVM* vm);
 void vmPush(struct sVM* vm, Value val);